@@ -75,10 +75,9 @@ require_overlay(function()
 	--       but that doesn't include the stages before it, which make the whole process
 	--       non-deterministic due to Lua hash table traversal order noise
 	local optimizer = optimize.make_optimizer(1337, 4)
-	local temp_initial = 1
-	local temp_final = 0.95
-	local temp_loss = 1e-7
-	optimizer:state(design:initial(), temp_initial)
+	local initial = design:initial()
+	local temp_initial, temp_final, temp_loss = optimize.calibrate(initial, 500000, 1337)
+	optimizer:state(initial, temp_initial)
 	optimizer:dispatch(temp_final, temp_loss, 1000)
 	local text_x, text_y = 80, 120
 	local box_size = 5
@@ -1,4 +1,5 @@
 #include "optimize.hpp"
+#include <numeric>
 #include <sstream>
 #include <lua.hpp>
 
@@ -7,7 +8,7 @@ namespace
 	struct StateHandle
 	{
 		static constexpr auto mtName = "spaghetti.optimize.state";
-		std::shared_ptr<State> state;
+		std::shared_ptr<const State> state;
 
 		static int Gc(lua_State *L);
 		static int Tostring(lua_State *L);
@@ -41,9 +42,10 @@ namespace
 		static int Ready(lua_State *L);
 		static int Dispatched(lua_State *L);
 		static int Dispatch(lua_State *L);
+		static int MoveKindStatsWrapper(lua_State *L);
 	};
 
-	int MakeStateHandle(lua_State *L, std::shared_ptr<State> state)
+	int MakeStateHandle(lua_State *L, std::shared_ptr<const State> state)
 	{
 		auto *stateHandle = reinterpret_cast<StateHandle *>(lua_newuserdata(L, sizeof(StateHandle)));
 		if (!stateHandle)
@@ -90,14 +92,14 @@ namespace
 	{
 		auto *stateHandle = reinterpret_cast<StateHandle *>(luaL_checkudata(L, 1, StateHandle::mtName));
 		const auto &state = *stateHandle->state;
-		auto plan = state.GetEnergy<EnergyWithPlan>();
+		auto cachedPlan = state.GetCachedEnergy<EnergyWithPlan>();
+		auto &plan = *cachedPlan;
 		lua_pushnumber(L, plan.linear);
 		lua_pushinteger(L, plan.storageSlotCount);
 		lua_pushinteger(L, plan.partCount);
 		lua_newtable(L);
 		{
 			auto &steps = plan.GetSteps();
-			auto &layers = state.GetLayers();
 			auto *design = state.GetDesign();
 			auto &nodes = design->Nodes();
 			lua_newtable(L);
@@ -153,7 +155,7 @@ namespace
 				}
 				handleStoragePlanStep(step);
 			}
-			for (int32_t layerIndex = 1; layerIndex < int32_t(layers.size()) - 1; ++layerIndex)
+			for (int32_t layerIndex = 1; layerIndex < state.LayerCount() - 1; ++layerIndex)
 			{
 				auto storageSlotsCopy = storageSlots;
 				struct WorkSlotState
@@ -213,7 +215,7 @@ namespace
 		std::shared_ptr<Plan> plan;
 		try
 		{
-			plan = stateHandle->state->GetEnergy<EnergyWithPlan>().ToPlan();
+			plan = stateHandle->state->GetCachedEnergy<EnergyWithPlan>()->ToPlan();
 		}
 		catch (const EnergyWithPlan::ToPlanFailed &ex)
 		{
@@ -475,6 +477,139 @@ namespace
 		return 1;
 	}
 
+	// indexed by Proposal
+	const char *const proposalNames[] = {
+		"enumerate",
+		"rejection",
+		"index",
+		"guided",
+		nullptr,
+	};
+
+	// indexed by Cooling
+	const char *const coolingNames[] = {
+		"linear",
+		"geometric",
+		"adaptive",
+		nullptr,
+	};
+
+	// indexed by MoveKind
+	const char *const moveKindNames[] = {
+		"single",
+		"swap",
+		"chain",
+		"merge",
+		"split",
+		"reorder",
+		"operands",
+	};
+
+	// a table of weights keyed by move kind name; missing kinds are not picked, except for single moves
+	MoveKindWeights OptMoveKindWeights(lua_State *L, int narg)
+	{
+		auto moveKindWeights = singleMovesOnly;
+		if (lua_isnoneornil(L, narg))
+		{
+			return moveKindWeights;
+		}
+		luaL_checktype(L, narg, LUA_TTABLE);
+		for (int32_t moveKind = 0; moveKind < moveKindMax; ++moveKind)
+		{
+			lua_getfield(L, narg, moveKindNames[moveKind]);
+			if (lua_type(L, -1) != LUA_TNIL)
+			{
+				if (lua_type(L, -1) != LUA_TNUMBER || !(lua_tonumber(L, -1) >= 0))
+				{
+					luaL_error(L, "move kind weight %s is not a non-negative number", moveKindNames[moveKind]);
+				}
+				moveKindWeights[moveKind] = lua_tonumber(L, -1);
+			}
+			lua_pop(L, 1);
+		}
+		if (!(std::accumulate(moveKindWeights.begin(), moveKindWeights.end(), 0.0) > 0))
+		{
+			luaL_error(L, "move kind weights are all zero");
+		}
+		return moveKindWeights;
+	}
+
+	void CheckCooling(lua_State *L, const Optimizer::DispatchParameters &dp)
+	{
+		if (dp.cooling == coolingGeometric && !(dp.temperatureFinal > 0))
+		{
+			luaL_error(L, "geometric cooling needs a positive final temperature");
+		}
+		if (dp.reheatAfter < 0 || dp.reheatLimit < 0 || !(dp.reheatFactor >= 1))
+		{
+			luaL_error(L, "reheating needs a non-negative iteration count and limit, and a factor of at least 1");
+		}
+	}
+
+	// a portfolio entry of Optimizer::DispatchParameters, fields that aren't present are taken from base
+	Optimizer::DispatchParameters CheckPortfolioEntry(lua_State *L, int narg, const Optimizer::DispatchParameters &base)
+	{
+		Optimizer::DispatchParameters entry = base;
+		entry.portfolio.clear();
+		lua_getfield(L, narg, "temperature_final");
+		entry.temperatureFinal = luaL_optnumber(L, -1, entry.temperatureFinal);
+		lua_getfield(L, narg, "temperature_loss");
+		entry.temperatureLoss = luaL_optnumber(L, -1, entry.temperatureLoss);
+		lua_getfield(L, narg, "iteration_count");
+		entry.iterationCount = luaL_optinteger(L, -1, entry.iterationCount);
+		lua_getfield(L, narg, "proposal");
+		entry.proposal = Proposal(luaL_checkoption(L, -1, proposalNames[entry.proposal], proposalNames));
+		lua_getfield(L, narg, "adaptive_move_kinds");
+		if (lua_type(L, -1) != LUA_TNIL)
+		{
+			entry.adaptiveMoveKinds = lua_toboolean(L, -1);
+		}
+		lua_getfield(L, narg, "speculation");
+		entry.speculation = luaL_optinteger(L, -1, entry.speculation);
+		lua_getfield(L, narg, "multi_try");
+		entry.multiTry = luaL_optinteger(L, -1, entry.multiTry);
+		lua_getfield(L, narg, "move_kinds");
+		if (lua_type(L, -1) != LUA_TNIL)
+		{
+			entry.moveKindWeights = OptMoveKindWeights(L, lua_gettop(L));
+		}
+		lua_getfield(L, narg, "cooling");
+		entry.cooling = Cooling(luaL_checkoption(L, -1, coolingNames[entry.cooling], coolingNames));
+		lua_getfield(L, narg, "reheat_after");
+		entry.reheatAfter = luaL_optinteger(L, -1, entry.reheatAfter);
+		lua_getfield(L, narg, "reheat_factor");
+		entry.reheatFactor = luaL_optnumber(L, -1, entry.reheatFactor);
+		lua_getfield(L, narg, "reheat_limit");
+		entry.reheatLimit = luaL_optinteger(L, -1, entry.reheatLimit);
+		lua_pop(L, 12);
+		if (entry.speculation < 1 || entry.multiTry < 1)
+		{
+			luaL_error(L, "speculation and multi-try candidate count must be positive");
+		}
+		CheckCooling(L, entry);
+		return entry;
+	}
+
+	// a table keyed by move kind name, of tables with the statistics and the weight each kind ended up with
+	void PushMoveKindStats(lua_State *L, const OptimizerState &ostate)
+	{
+		lua_newtable(L);
+		for (int32_t moveKind = 0; moveKind < moveKindMax; ++moveKind)
+		{
+			auto &stats = ostate.moveKindStats[moveKind];
+			lua_newtable(L);
+			lua_pushinteger(L, stats.proposalCount);
+			lua_setfield(L, -2, "proposals");
+			lua_pushinteger(L, stats.acceptanceCount);
+			lua_setfield(L, -2, "acceptances");
+			lua_pushnumber(L, stats.proposalCount ? (stats.improvementSum / double(stats.proposalCount)) : 0.0);
+			lua_setfield(L, -2, "mean_improvement");
+			lua_pushnumber(L, ostate.moveKindWeights[moveKind]);
+			lua_setfield(L, -2, "weight");
+			lua_setfield(L, -2, moveKindNames[moveKind]);
+		}
+	}
+
 	int OptimizeOnceWrapper(lua_State *L)
 	{
 		auto *stateHandle = reinterpret_cast<StateHandle *>(luaL_checkudata(L, 1, StateHandle::mtName));
@@ -483,11 +618,52 @@ namespace
 		double temperatureLoss = luaL_checknumber(L, 4);
 		int32_t iterationCount = luaL_checkinteger(L, 5);
 		uint64_t seed = luaL_checkinteger(L, 6);
+		auto proposal = Proposal(luaL_checkoption(L, 7, proposalNames[proposalRejection], proposalNames));
+		auto moveKindWeights = OptMoveKindWeights(L, 8);
+		bool adaptiveMoveKinds = lua_toboolean(L, 9);
+		int32_t speculation = luaL_optinteger(L, 10, 1);
+		if (speculation < 1)
+		{
+			return luaL_error(L, "speculation must be positive");
+		}
+		int32_t multiTry = luaL_optinteger(L, 11, 1);
+		if (multiTry < 1)
+		{
+			return luaL_error(L, "multi-try candidate count must be positive");
+		}
 		std::mt19937_64 rng(seed);
-		auto ostate = OptimizeOnce(rng, *stateHandle->state, { iterationCount, temperatureInitial, temperatureFinal, temperatureLoss });
-		MakeStateHandle(L, std::make_shared<State>(*ostate.state));
+		auto ostate = OptimizeOnce(rng, *stateHandle->state, { iterationCount, temperatureInitial, temperatureFinal, temperatureLoss, proposal, moveKindWeights, adaptiveMoveKinds, speculation, multiTry });
+		// share the state so that its cached energy is shared too
+		MakeStateHandle(L, ostate.state);
 		lua_pushnumber(L, ostate.temperature);
-		return 2;
+		PushMoveKindStats(L, ostate);
+		return 3;
+	}
+
+	// returns initial and final temperatures and a loss, see Calibrate
+	int CalibrateWrapper(lua_State *L)
+	{
+		auto *stateHandle = reinterpret_cast<StateHandle *>(luaL_checkudata(L, 1, StateHandle::mtName));
+		CalibrationParameters cp{ luaL_checkinteger(L, 2) };
+		uint64_t seed = luaL_checkinteger(L, 3);
+		cp.cooling = Cooling(luaL_checkoption(L, 4, coolingNames[coolingLinear], coolingNames));
+		cp.acceptanceInitial = luaL_optnumber(L, 5, cp.acceptanceInitial);
+		cp.acceptanceFinal = luaL_optnumber(L, 6, cp.acceptanceFinal);
+		cp.sampleCount = luaL_optinteger(L, 7, cp.sampleCount);
+		if (cp.iterationCount < 1)
+		{
+			return luaL_error(L, "iteration count must be positive");
+		}
+		if (!(0 < cp.acceptanceFinal && cp.acceptanceFinal < cp.acceptanceInitial && cp.acceptanceInitial < 1))
+		{
+			return luaL_error(L, "acceptance probabilities must be between 0 and 1, the final one lower");
+		}
+		std::mt19937_64 rng(seed);
+		auto calibration = Calibrate(rng, *stateHandle->state, cp);
+		lua_pushnumber(L, calibration.temperatureInitial);
+		lua_pushnumber(L, calibration.temperatureFinal);
+		lua_pushnumber(L, calibration.temperatureLoss);
+		return 3;
 	}
 
 	int HardwareConcurrency(lua_State *L)
@@ -524,10 +700,100 @@ namespace
 		double temperatureFinal = luaL_checknumber(L, 2);
 		double temperatureLoss = luaL_checknumber(L, 3);
 		int32_t iterationCount = luaL_checkinteger(L, 4);
-		optimizerHandle->optimizer->Dispatch({ iterationCount, temperatureFinal, temperatureLoss });
+		auto proposal = Proposal(luaL_checkoption(L, 5, proposalNames[proposalRejection], proposalNames));
+		auto moveKindWeights = OptMoveKindWeights(L, 6);
+		bool adaptiveMoveKinds = lua_toboolean(L, 7);
+		// an array of temperature ratios, one per thread, see Optimizer::DispatchParameters
+		std::vector<double> temperatureLadder;
+		if (!lua_isnoneornil(L, 8))
+		{
+			luaL_checktype(L, 8, LUA_TTABLE);
+			auto rungCount = lua_objlen(L, 8);
+			if (rungCount != optimizerHandle->optimizer->threadCount)
+			{
+				return luaL_error(L, "temperature ladder needs one ratio per thread");
+			}
+			for (size_t rungIndex = 0; rungIndex < rungCount; ++rungIndex)
+			{
+				lua_rawgeti(L, 8, int(rungIndex) + 1);
+				auto ratio = lua_tonumber(L, -1);
+				lua_pop(L, 1);
+				if (!(ratio > 0) || (rungIndex && !(ratio >= temperatureLadder.back())))
+				{
+					return luaL_error(L, "temperature ladder ratios must be positive and ascending");
+				}
+				temperatureLadder.push_back(ratio);
+			}
+		}
+		// island mode if given, see Optimizer::DispatchParameters
+		std::optional<double> migrationRate;
+		if (!lua_isnoneornil(L, 9))
+		{
+			migrationRate = luaL_checknumber(L, 9);
+			if (!(*migrationRate >= 0 && *migrationRate <= 1))
+			{
+				return luaL_error(L, "migration rate must be between 0 and 1");
+			}
+			if (!temperatureLadder.empty())
+			{
+				return luaL_error(L, "island mode doesn't take a temperature ladder");
+			}
+		}
+		int32_t speculation = luaL_optinteger(L, 10, 1);
+		if (speculation < 1)
+		{
+			return luaL_error(L, "speculation must be positive");
+		}
+		int32_t multiTry = luaL_optinteger(L, 11, 1);
+		if (multiTry < 1)
+		{
+			return luaL_error(L, "multi-try candidate count must be positive");
+		}
+		Optimizer::DispatchParameters dp{ iterationCount, temperatureFinal, temperatureLoss, proposal, moveKindWeights, adaptiveMoveKinds, temperatureLadder, migrationRate, speculation, multiTry };
+		// see Cooling and OptimizeParameters
+		dp.cooling = Cooling(luaL_checkoption(L, 13, coolingNames[coolingLinear], coolingNames));
+		dp.reheatAfter = luaL_optinteger(L, 14, dp.reheatAfter);
+		dp.reheatFactor = luaL_optnumber(L, 15, dp.reheatFactor);
+		dp.reheatLimit = luaL_optinteger(L, 16, dp.reheatLimit);
+		CheckCooling(L, dp);
+		// portfolio mode if given, see Optimizer::DispatchParameters; either a spread factor
+		// for Optimizer::SpreadPortfolio or an array of tables, one per thread, of what differs from the above
+		if (lua_type(L, 12) == LUA_TNUMBER)
+		{
+			auto spread = lua_tonumber(L, 12);
+			if (!(spread >= 1))
+			{
+				return luaL_error(L, "portfolio spread must be at least 1");
+			}
+			dp.portfolio = Optimizer::SpreadPortfolio(dp, optimizerHandle->optimizer->threadCount, spread);
+		}
+		else if (!lua_isnoneornil(L, 12))
+		{
+			luaL_checktype(L, 12, LUA_TTABLE);
+			auto entryCount = lua_objlen(L, 12);
+			if (entryCount != optimizerHandle->optimizer->threadCount)
+			{
+				return luaL_error(L, "portfolio needs one entry per thread");
+			}
+			for (size_t entryIndex = 0; entryIndex < entryCount; ++entryIndex)
+			{
+				lua_rawgeti(L, 12, int(entryIndex) + 1);
+				luaL_checktype(L, -1, LUA_TTABLE);
+				dp.portfolio.push_back(CheckPortfolioEntry(L, lua_gettop(L), dp));
+				lua_pop(L, 1);
+			}
+		}
+		optimizerHandle->optimizer->Dispatch(dp);
 		return 0;
 	}
 
+	int OptimizerHandle::MoveKindStatsWrapper(lua_State *L)
+	{
+		auto *optimizerHandle = reinterpret_cast<OptimizerHandle *>(luaL_checkudata(L, 1, OptimizerHandle::mtName));
+		PushMoveKindStats(L, optimizerHandle->optimizer->PeekState());
+		return 1;
+	}
+
 	int OptimizerHandle::Gc(lua_State *L)
 	{
 		auto *optimizerHandle = reinterpret_cast<OptimizerHandle *>(luaL_checkudata(L, 1, OptimizerHandle::mtName));
@@ -561,9 +827,17 @@ namespace
 		if (lua_gettop(L) < 2)
 		{
 			auto ostate = optimizerHandle->optimizer->PeekState();
-			MakeStateHandle(L, std::make_shared<State>(*ostate.state));
+			MakeStateHandle(L, ostate.state);
 			lua_pushnumber(L, ostate.temperature);
-			return 2;
+			if (ostate.portfolioIndex == -1)
+			{
+				lua_pushnil(L);
+			}
+			else
+			{
+				lua_pushinteger(L, ostate.portfolioIndex + 1);
+			}
+			return 3;
 		}
 		// TODO: stupid design, fix
 		if (optimizerHandle->optimizer->Dispatched() && optimizerHandle->optimizer->Ready())
@@ -600,12 +874,13 @@ extern "C" int luaopen_spaghetti_optimize(lua_State *L)
 	lua_newtable(L);
 	{
 		static const luaL_Reg optimizerReg[] = {
-			{ "wait"      , OptimizerHandle::Wait         },
-			{ "cancel"    , OptimizerHandle::Cancel       },
-			{ "state"     , OptimizerHandle::StateWrapper },
-			{ "ready"     , OptimizerHandle::Ready        },
-			{ "dispatched", OptimizerHandle::Dispatched   },
-			{ "dispatch"  , OptimizerHandle::Dispatch     },
+			{ "wait"           , OptimizerHandle::Wait                 },
+			{ "cancel"         , OptimizerHandle::Cancel               },
+			{ "state"          , OptimizerHandle::StateWrapper         },
+			{ "ready"          , OptimizerHandle::Ready                },
+			{ "dispatched"     , OptimizerHandle::Dispatched           },
+			{ "dispatch"       , OptimizerHandle::Dispatch             },
+			{ "move_kind_stats", OptimizerHandle::MoveKindStatsWrapper },
 			{ NULL, NULL }
 		};
 		luaL_newmetatable(L, OptimizerHandle::mtName);
@@ -659,6 +934,7 @@ extern "C" int luaopen_spaghetti_optimize(lua_State *L)
 	{
 		static const luaL_Reg optimizeReg[] = {
 			{ "optimize_once"       , OptimizeOnceWrapper  },
+			{ "calibrate"           , CalibrateWrapper     },
 			{ "make_design"         , DesignHandle::New    },
 			{ "make_optimizer"      , OptimizerHandle::New },
 			{ "hardware_concurrency", HardwareConcurrency },
@@ -5,10 +5,8 @@
 
 int main()
 {
-	constexpr auto    temperatureInitial = 1.0;
-	constexpr auto    temperatureFinal   = 0.95;
-	constexpr auto    temperatureLoss    = 1e-7;
-	constexpr int32_t iterationCount     = 100000;
+	constexpr int64_t iterationBudget = 500000;
+	constexpr int32_t iterationCount  = 100000;
 	auto design = std::make_shared<Design>();
 	try
 	{
@@ -25,16 +23,19 @@ int main()
 		return 2;
 	}
 	auto optimizer = std::make_shared<Optimizer>();
-	optimizer->PokeState({ design->Initial(), temperatureInitial });
 	std::random_device rd;
 	optimizer->threadCount = std::thread::hardware_concurrency();
 	optimizer->rng.seed(rd());
+	auto initial = design->Initial();
+	auto calibration = Calibrate(optimizer->rng, *initial, { iterationBudget });
+	optimizer->PokeState({ initial, calibration.temperatureInitial });
 	std::cerr << *optimizer->PeekState().state;
-	optimizer->Dispatch({ iterationCount, temperatureFinal, temperatureLoss });
+	std::cerr << "temperatures: " << calibration.temperatureInitial << " to " << calibration.temperatureFinal << std::endl;
+	optimizer->Dispatch({ iterationCount, calibration.temperatureFinal, calibration.temperatureLoss });
 	while (!optimizer->Ready())
 	{
 		auto ostate = optimizer->PeekState();
-		std::cerr << "temperature: " << ostate.temperature << std::endl;
+		std::cerr << "temperature: " << ostate.temperature << ", energy: " << ostate.state->GetCachedEnergy<Energy>()->linear << std::endl;
 		std::cerr << *ostate.state;
 		std::this_thread::sleep_for(std::chrono::seconds(1));
 	}
@@ -44,7 +45,7 @@ int main()
 	std::shared_ptr<Plan> plan;
 	try
 	{
-		plan = ostate.state->GetEnergy<EnergyWithPlan>().ToPlan();
+		plan = ostate.state->GetCachedEnergy<EnergyWithPlan>()->ToPlan();
 	}
 	catch (const EnergyWithPlan::ToPlanFailed &ex)
 	{
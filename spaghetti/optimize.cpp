@@ -2,9 +2,15 @@
 #include <algorithm>
 #include <cassert>
 #include <condition_variable>
+#include <functional>
 #include <iomanip>
 #include <iterator>
+#include <limits>
 #include <mutex>
+#include <numeric>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #include <iostream>
 
@@ -30,261 +36,1375 @@ namespace
 
 	constexpr int32_t lsnsLife3Value  = 0x10000003;
 
+	constexpr int32_t wordBits = 64;
+
+	int32_t WordCount(int32_t bitCount)
+	{
+		return (bitCount + wordBits - 1) / wordBits;
+	}
+
+	uint64_t WordBit(int32_t bitIndex)
+	{
+		return uint64_t(1) << (bitIndex % wordBits);
+	}
+
+	int32_t CountTrailingZeros(uint64_t word)
+	{
+		assert(word);
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, word);
+		return int32_t(index);
+#else
+		return __builtin_ctzll(word);
+#endif
+	}
+
+	int32_t PopCount(uint64_t word)
+	{
+#ifdef _MSC_VER
+		return int32_t(__popcnt64(word));
+#else
+		return __builtin_popcountll(word);
+#endif
+	}
+
+	SameLayerRule SameLayerRuleOf(const std::vector<Node> &nodes, const Link &link)
+	{
+		auto &downstreamNode = nodes[link.directions[linkDownstream].nodeIndex];
+		switch (link.type)
+		{
+		case Link::toBinary:
+			{
+				int32_t lhsIndex = 1;
+				if (downstreamNode.type == Node::select)
+				{
+					auto laneCount = int32_t(downstreamNode.sources.size());
+					lhsIndex += laneCount * 2;
+				}
+				auto linkIndicesIndex = link.directions[linkDownstream].linkIndicesIndex;
+				if (linkIndicesIndex == lhsIndex && !tmpCommutativity[downstreamNode.tmps[0]])
+				{
+					// binary same-layer link to lhs of non-commutative node
+					return sameLayerForbid;
+				}
+				if (linkIndicesIndex > lhsIndex)
+				{
+					// binary same-layer link to parameter of higher index than that of rhs or lhs
+					return sameLayerForbid;
+				}
+				return sameLayerChain;
+			}
+
+		case Link::toSelectNonzero:
+			// nonzero same-layer link
+			return sameLayerForbid;
+
+		case Link::toSelectZero:
+			return sameLayerSave;
+
+		default:
+			break;
+		}
+		return sameLayerIgnore;
+	}
+
+	template<class Index>
+	FlatGraph<Index> MakeFlatGraph(const std::vector<Node> &nodes, const std::vector<Link> &links)
+	{
+		FlatGraph<Index> flat;
+		flat.sourceBegins.push_back(0);
+		flat.tmpBegins.push_back(0);
+		for (auto dir = LinkDirection(0); dir < linkMax; dir = LinkDirection(int32_t(dir) + 1))
+		{
+			flat.linkBegins[dir].push_back(0);
+		}
+		for (auto &node : nodes)
+		{
+			flat.nodeTypes.push_back(uint8_t(node.type));
+			flat.workSlotsNeeded.push_back(int16_t(node.workSlotsNeeded));
+			flat.sources.insert(flat.sources.end(), node.sources.begin(), node.sources.end());
+			flat.sourceBegins.push_back(Index(flat.sources.size()));
+			flat.tmps.insert(flat.tmps.end(), node.tmps.begin(), node.tmps.end());
+			flat.tmpBegins.push_back(Index(flat.tmps.size()));
+			for (auto dir = LinkDirection(0); dir < linkMax; dir = LinkDirection(int32_t(dir) + 1))
+			{
+				for (auto linkIndex : node.linkIndices[dir])
+				{
+					auto &link = links[linkIndex];
+					auto &upstreamNode = nodes[link.directions[linkUpstream].nodeIndex];
+					flat.linkTypes[dir].push_back(uint8_t(link.type));
+					flat.linkedNodeIndices[dir].push_back(Index(link.directions[dir].nodeIndex));
+					flat.linkedLinkIndicesIndices[dir].push_back(Index(link.directions[dir].linkIndicesIndex));
+					flat.linkSources[dir].push_back(Index(upstreamNode.sources[link.upstreamOutputIndex]));
+					flat.sameLayerRules[dir].push_back(SameLayerRuleOf(nodes, link));
+				}
+				flat.linkBegins[dir].push_back(Index(flat.linkTypes[dir].size()));
+			}
+		}
+		return flat;
+	}
+
+	std::atomic<uint64_t> nextDesignSerial = 1;
+
+	// marks the nodes of the layer being checked by Design::CheckLayer
+	struct LayerMarks
+	{
+		std::vector<uint32_t> nodeStamps;
+		uint32_t stamp = 0;
+
+		void Reset(int32_t nodeCount)
+		{
+			if (int32_t(nodeStamps.size()) < nodeCount)
+			{
+				nodeStamps.resize(nodeCount, 0);
+			}
+			stamp += 1;
+			if (!stamp)
+			{
+				std::fill(nodeStamps.begin(), nodeStamps.end(), 0);
+				stamp = 1;
+			}
+		}
+	};
+	thread_local LayerMarks layerMarks;
+
+	// direct-mapped, keyed by the layer hash and the node being inserted; entries also remember the order hash
+	// and the size of the layer they were made for, so a wrong result takes two independent 64-bit hashes colliding
+	struct LayerCheckCache
+	{
+		struct Entry
+		{
+			uint64_t designSerial = 0;
+			uint64_t key = 0;
+			uint64_t orderHash = 0;
+			int32_t layerSize = -1;
+			int32_t extraNodeIndex = -1;
+			bool fits = false;
+		};
+		static constexpr int32_t entryCountLog = 12;
+		std::vector<Entry> entries;
+
+		Entry &Get(uint64_t key)
+		{
+			if (entries.empty())
+			{
+				entries.resize(1 << entryCountLog);
+			}
+			return entries[key >> (64 - entryCountLog)];
+		}
+	};
+	thread_local LayerCheckCache layerCheckCache;
+
+	// see State::LayerBlock; cheap next to the insertion or removal that comes before it
+	uint64_t LayerOrderHash(const std::vector<int32_t> &nodeIndices)
+	{
+		uint64_t hash = 0;
+		for (auto nodeIndex : nodeIndices)
+		{
+			hash = (hash ^ (uint64_t(nodeIndex) + 1) * UINT64_C(0x9E3779B97F4A7C15)) * UINT64_C(0xBF58476D1CE4E5B9);
+			hash ^= hash >> 31;
+		}
+		return hash;
+	}
+
+	// valid moves of the node being considered by State::GuidedMoveProbability
+	thread_local std::vector<Move> guidedMoves;
+	// probability of State::GuidedMove picking a node around the peak layer, if there are any
+	constexpr double guidedShare = 0.5;
+
+	// doesn't touch the rng if there's nothing but moveSingle to pick, so single moves see the same sequence either way
+	MoveKind RandomMoveKind(std::mt19937_64 &rng, const MoveKindWeights &moveKindWeights)
+	{
+		if (std::none_of(moveKindWeights.begin() + 1, moveKindWeights.end(), [](auto weight) {
+			return weight > 0;
+		}))
+		{
+			return moveSingle;
+		}
+		std::discrete_distribution<int32_t> moveKindDist(moveKindWeights.begin(), moveKindWeights.end());
+		return MoveKind(moveKindDist(rng));
+	}
+
 	struct CheckStream
 	{
-	};
-	std::istream &operator >>(std::istream &stream, const CheckStream &checkCin)
+	};
+	std::istream &operator >>(std::istream &stream, const CheckStream &checkCin)
+	{
+		if (!stream)
+		{
+			throw StreamFailed("stream failed");
+		}
+		return stream;
+	}
+}
+
+State::LayerBlock &State::MutableLayer(int32_t layerIndex)
+{
+	auto &layerBlock = layerBlocks[layerIndex];
+	// only this state can be looking at it if it's not shared, see LayerBlock
+	if (layerBlock.use_count() != 1)
+	{
+		layerBlock = std::make_shared<LayerBlock>(*layerBlock);
+	}
+	return *layerBlock;
+}
+
+int32_t State::InsertPosition(int32_t layerIndex, int32_t extraNodeIndex) const
+{
+	// we assume that inserting the node into this layer doesn't violate order
+	// we only have to figure out where within the layer it should be inserted
+	auto &layerNodes = LayerNodes(layerIndex);
+	return std::visit([&layerNodes, extraNodeIndex](auto &flat) {
+		// insert up front by default, or at the back if it's a select
+		int32_t insertAt = flat.nodeTypes[extraNodeIndex] == Node::select ? int32_t(layerNodes.size()) : 0;
+		for (int32_t offset = 0; offset < int32_t(layerNodes.size()); ++offset)
+		{
+			auto nodeIndex = layerNodes[offset];
+			for (auto dir = LinkDirection(0); dir < linkMax; dir = LinkDirection(int32_t(dir) + 1))
+			{
+				for (int32_t linkEnd = flat.linkBegins[dir][nodeIndex]; linkEnd < flat.linkBegins[dir][nodeIndex + 1]; ++linkEnd)
+				{
+					if (flat.linkTypes[dir][linkEnd] == Link::toBinary && flat.linkedNodeIndices[dir][linkEnd] == extraNodeIndex)
+					{
+						// due to the order assumption above, this runs in only one of the dir iterations
+						// not necessarily in only one of the linkEnd iterations, but that problem is handled elsewhere
+						insertAt = dir == linkUpstream ? offset : (offset + 1);
+					}
+				}
+			}
+		}
+		return insertAt;
+	}, design->flat);
+}
+
+std::vector<int32_t> State::InsertNode(int32_t layerIndex, int32_t extraNodeIndex) const
+{
+	auto nodeIndicesCopy = LayerNodes(layerIndex);
+	nodeIndicesCopy.insert(nodeIndicesCopy.begin() + InsertPosition(layerIndex, extraNodeIndex), extraNodeIndex);
+	return nodeIndicesCopy;
+}
+
+bool State::CheckInsertNode(int32_t layerIndex, int32_t extraNodeIndex) const
+{
+	auto &layerBlock = *layerBlocks[layerIndex];
+	// multiply so that inserting a into {b} and b into {a} get different keys
+	auto key = layerBlock.hash ^ (design->nodeHashKeys[extraNodeIndex] * UINT64_C(0x9E3779B97F4A7C15));
+	auto layerSize = int32_t(layerBlock.nodeIndices.size());
+	auto &entry = layerCheckCache.Get(key);
+	if (entry.designSerial == design->serial &&
+	    entry.key == key &&
+	    entry.orderHash == layerBlock.orderHash &&
+	    entry.layerSize == layerSize &&
+	    entry.extraNodeIndex == extraNodeIndex)
+	{
+		return entry.fits;
+	}
+	entry.designSerial = design->serial;
+	entry.key = key;
+	entry.orderHash = layerBlock.orderHash;
+	entry.layerSize = layerSize;
+	entry.extraNodeIndex = extraNodeIndex;
+	entry.fits = bool(design->CheckLayer(InsertNode(layerIndex, extraNodeIndex)));
+	return entry.fits;
+}
+
+State::MoveLimits State::GetMoveLimits(int32_t nodeIndex) const
+{
+	auto currLayerIndex = nodeLayerIndices[nodeIndex];
+	MoveLimits moveLimits;
+	// move it somewhere between before the first and after the last composite layers, and within
+	// its mobility window; neither of these are tighter than the limits set by the neighbours below
+	// while the state is valid, but they're known ahead of time, see MoveInWindow
+	moveLimits.limit = {{
+		std::max(1, design->asapLayers[nodeIndex] * 2 - 1),
+		std::min(LayerCount() * 2 - 3, design->AlapLayer(nodeIndex, LayerCount()) * 2 + 1),
+	}};
+	// don't move it to the same layer
+	moveLimits.skip = {{ currLayerIndex * 2, currLayerIndex * 2 }};
+	for (auto dir = LinkDirection(0); dir < linkMax; dir = LinkDirection(int32_t(dir) + 1))
+	{
+		auto sign = dir == linkUpstream ? 1 : -1;
+		std::visit([this, &moveLimits, nodeIndex, dir, sign](auto &flat) {
+			for (int32_t linkEnd = flat.linkBegins[dir][nodeIndex]; linkEnd < flat.linkBegins[dir][nodeIndex + 1]; ++linkEnd)
+			{
+				auto linkedNodeIndex = flat.linkedNodeIndices[dir][linkEnd];
+				// don't move to layers that are beyond the closest neighbouring nodes, or into their layers
+				// if the link between them doesn't allow that, CheckLayer would reject those moves anyway
+				auto limit = nodeLayerIndices[linkedNodeIndex] * 2;
+				if (flat.sameLayerRules[dir][linkEnd] == sameLayerForbid)
+				{
+					limit += sign;
+				}
+				moveLimits.limit[dir] = sign * std::max(sign * moveLimits.limit[dir], sign * limit);
+			}
+		}, design->flat);
+		if (LayerSize(currLayerIndex) == 1)
+		{
+			// don't move it before or after the same layer either if that layer would just disappear
+			moveLimits.skip[dir] -= sign;
+		}
+	}
+	return moveLimits;
+}
+
+bool State::MoveInWindow(const Move &move) const
+{
+	return move.layerIndex2 >= design->asapLayers[move.nodeIndex] * 2 - 1 &&
+	       move.layerIndex2 <= design->AlapLayer(move.nodeIndex, LayerCount()) * 2 + 1;
+}
+
+bool State::MoveValid(const Move &move, const MoveLimits &moveLimits) const
+{
+	if (move.layerIndex2 < moveLimits.limit[linkUpstream] || move.layerIndex2 > moveLimits.limit[linkDownstream])
+	{
+		return false;
+	}
+	if (move.layerIndex2 >= moveLimits.skip[linkUpstream] && move.layerIndex2 <= moveLimits.skip[linkDownstream])
+	{
+		return false;
+	}
+	// make sure we can move it to an existing layer
+	if (!(move.layerIndex2 & 1) && !CheckInsertNode(int32_t(move.layerIndex2 / 2), move.nodeIndex))
+	{
+		return false;
+	}
+	return true;
+}
+
+void State::NodeValidMoves(int32_t nodeIndex, std::vector<Move> &moves) const
+{
+	auto moveLimits = GetMoveLimits(nodeIndex);
+	for (int32_t newLayerIndex2 = moveLimits.limit[linkUpstream]; newLayerIndex2 <= moveLimits.limit[linkDownstream]; ++newLayerIndex2)
+	{
+		Move move{ nodeIndex, newLayerIndex2 };
+		if (MoveValid(move, moveLimits))
+		{
+			moves.push_back(move);
+		}
+	}
+}
+
+std::vector<Move> State::ValidMoves() const
+{
+	std::vector<Move> moves;
+	for (int32_t compositeIndex = 0; compositeIndex < design->compositeCount; ++compositeIndex)
+	{
+		auto nodeIndex = design->constantCount + design->inputCount + compositeIndex;
+		NodeValidMoves(nodeIndex, moves);
+	}
+	return moves;
+}
+
+void MoveIndex::Add(int32_t nodeIndex, int32_t targetId)
+{
+	auto entryIndex = int32_t(entries.size());
+	if (int32_t(targetEntries.size()) <= targetId)
+	{
+		targetEntries.resize(targetId + 1);
+	}
+	auto &entryIndicesOfNode = nodeEntries[nodeIndex];
+	auto &entryIndicesOfTarget = targetEntries[targetId];
+	entries.push_back({ nodeIndex, targetId, int32_t(entryIndicesOfNode.size()), int32_t(entryIndicesOfTarget.size()) });
+	entryIndicesOfNode.push_back(entryIndex);
+	entryIndicesOfTarget.push_back(entryIndex);
+}
+
+void MoveIndex::Remove(int32_t entryIndex)
+{
+	auto entry = entries[entryIndex];
+	auto &entryIndicesOfNode = nodeEntries[entry.nodeIndex];
+	entryIndicesOfNode[entry.nodeEntriesIndex] = entryIndicesOfNode.back();
+	entries[entryIndicesOfNode.back()].nodeEntriesIndex = entry.nodeEntriesIndex;
+	entryIndicesOfNode.pop_back();
+	auto &entryIndicesOfTarget = targetEntries[entry.targetId];
+	entryIndicesOfTarget[entry.targetEntriesIndex] = entryIndicesOfTarget.back();
+	entries[entryIndicesOfTarget.back()].targetEntriesIndex = entry.targetEntriesIndex;
+	entryIndicesOfTarget.pop_back();
+	auto lastEntryIndex = int32_t(entries.size()) - 1;
+	if (entryIndex != lastEntryIndex)
+	{
+		auto &lastEntry = entries[lastEntryIndex];
+		nodeEntries[lastEntry.nodeIndex][lastEntry.nodeEntriesIndex] = entryIndex;
+		targetEntries[lastEntry.targetId][lastEntry.targetEntriesIndex] = entryIndex;
+		entries[entryIndex] = lastEntry;
+	}
+	entries.pop_back();
+}
+
+void MoveIndex::RemoveNode(int32_t nodeIndex)
+{
+	auto &entryIndices = nodeEntries[nodeIndex];
+	while (entryIndices.size())
+	{
+		Remove(entryIndices.back());
+	}
+}
+
+void MoveIndex::RemoveTarget(int32_t targetId)
+{
+	if (targetId >= int32_t(targetEntries.size()))
+	{
+		return;
+	}
+	auto &entryIndices = targetEntries[targetId];
+	while (entryIndices.size())
+	{
+		Remove(entryIndices.back());
+	}
+}
+
+int32_t MoveIndex::NewLayerId()
+{
+	if (freeLayerIds.size())
+	{
+		auto layerId = freeLayerIds.back();
+		freeLayerIds.pop_back();
+		return layerId;
+	}
+	layerIndices.push_back(-1);
+	return int32_t(layerIndices.size()) - 1;
+}
+
+void MoveIndex::SetLayerIds()
+{
+	for (auto layerId : layerIds)
+	{
+		layerIndices[layerId] = -1;
+	}
+	// the old ids are the next newLayerIds, no need to give up their storage
+	std::swap(layerIds, newLayerIds);
+	for (int32_t layerIndex = 0; layerIndex < int32_t(layerIds.size()); ++layerIndex)
+	{
+		layerIndices[layerIds[layerIndex]] = layerIndex;
+	}
+}
+
+std::optional<Move> MoveIndex::RandomMove(std::mt19937_64 &rng) const
+{
+	if (!entries.size())
+	{
+		return std::nullopt;
+	}
+	auto &entry = entries[rng() % entries.size()];
+	return Move{ entry.nodeIndex, TargetLayerIndex2(entry.targetId) };
+}
+
+std::vector<Move> MoveIndex::Moves() const
+{
+	std::vector<Move> moves;
+	for (auto &entry : entries)
+	{
+		moves.push_back({ entry.nodeIndex, TargetLayerIndex2(entry.targetId) });
+	}
+	return moves;
+}
+
+void State::AddNodeMoves(int32_t nodeIndex)
+{
+	auto moveLimits = GetMoveLimits(nodeIndex);
+	for (int32_t newLayerIndex2 = moveLimits.limit[linkUpstream]; newLayerIndex2 <= moveLimits.limit[linkDownstream]; ++newLayerIndex2)
+	{
+		if (MoveValid({ nodeIndex, newLayerIndex2 }, moveLimits))
+		{
+			moveIndex->Add(nodeIndex, moveIndex->LayerIndex2Target(newLayerIndex2));
+		}
+	}
+}
+
+void State::BuildMoveIndex()
+{
+	moveIndex = std::make_unique<MoveIndex>();
+	moveIndex->nodeEntries.resize(design->nodes.size());
+	moveIndex->redone.resize(design->nodes.size(), false);
+	moveIndex->candidate.resize(design->nodes.size(), false);
+	for (int32_t layerIndex = 0; layerIndex < LayerCount(); ++layerIndex)
+	{
+		moveIndex->newLayerIds.push_back(moveIndex->NewLayerId());
+	}
+	moveIndex->SetLayerIds();
+	for (int32_t compositeIndex = 0; compositeIndex < design->compositeCount; ++compositeIndex)
+	{
+		AddNodeMoves(design->constantCount + design->inputCount + compositeIndex);
+	}
+	CheckMoveIndex();
+}
+
+void State::TakeMoveIndex(State &from, const Move &move)
+{
+	assert(from.moveIndex);
+	moveIndex = std::move(from.moveIndex);
+	auto sourceLayerIndex = from.nodeLayerIndices[move.nodeIndex];
+	auto sourceLayerSize = from.LayerSize(sourceLayerIndex);
+	auto sourceLayerId = moveIndex->layerIds[sourceLayerIndex];
+	auto sourceLayerRemoved = sourceLayerSize == 1;
+	std::optional<int32_t> targetLayerId;
+	std::optional<int32_t> newLayerId;
+	auto &layerIds = moveIndex->newLayerIds;
+	layerIds.clear();
+	// same walk as in Neighbour
+	for (int32_t layerIndex2 = 0; layerIndex2 < from.LayerCount() * 2; ++layerIndex2)
+	{
+		if (layerIndex2 & 1)
+		{
+			if (layerIndex2 == move.layerIndex2)
+			{
+				newLayerId = moveIndex->NewLayerId();
+				layerIds.push_back(*newLayerId);
+			}
+		}
+		else
+		{
+			auto layerIndex = int32_t(layerIndex2 / 2);
+			if (layerIndex2 == move.layerIndex2)
+			{
+				targetLayerId = moveIndex->layerIds[layerIndex];
+			}
+			if (!(layerIndex == sourceLayerIndex && sourceLayerRemoved))
+			{
+				layerIds.push_back(moveIndex->layerIds[layerIndex]);
+			}
+		}
+	}
+	// the moved node and its neighbours have new limits, and nodes left alone in a layer or no longer
+	// alone in one have new skip ranges; all their moves are redone from scratch
+	auto &redo = moveIndex->redoNodeIndices;
+	redo.clear();
+	redo.push_back(move.nodeIndex);
+	std::visit([&redo, &move](auto &flat) {
+		for (auto dir = LinkDirection(0); dir < linkMax; dir = LinkDirection(int32_t(dir) + 1))
+		{
+			for (int32_t linkEnd = flat.linkBegins[dir][move.nodeIndex]; linkEnd < flat.linkBegins[dir][move.nodeIndex + 1]; ++linkEnd)
+			{
+				redo.push_back(flat.linkedNodeIndices[dir][linkEnd]);
+			}
+		}
+	}, design->flat);
+	auto redoLayer = [&from, &redo](int32_t layerIndex) {
+		auto &layerNodes = from.LayerNodes(layerIndex);
+		redo.insert(redo.end(), layerNodes.begin(), layerNodes.end());
+	};
+	if (sourceLayerSize == 2)
+	{
+		redoLayer(sourceLayerIndex);
+	}
+	if (targetLayerId && from.LayerSize(move.layerIndex2 / 2) == 1)
+	{
+		redoLayer(move.layerIndex2 / 2);
+	}
+	// the skip range of a node alone in a layer includes the move right after the layer before it,
+	// which becomes a different move if a layer is removed or inserted right before its layer
+	auto redoLayerIfAlone = [&from, &redoLayer](int32_t layerIndex) {
+		if (layerIndex < from.LayerCount() && from.LayerSize(layerIndex) == 1)
+		{
+			redoLayer(layerIndex);
+		}
+	};
+	if (sourceLayerRemoved)
+	{
+		redoLayerIfAlone(sourceLayerIndex + 1);
+	}
+	if (newLayerId)
+	{
+		redoLayerIfAlone((move.layerIndex2 + 1) / 2);
+	}
+	moveIndex->SetLayerIds();
+	auto compositesBegin = design->constantCount + design->inputCount;
+	auto compositesEnd = compositesBegin + design->compositeCount;
+	auto &redone = moveIndex->redone;
+	// keep only the composites, each once
+	redo.erase(std::remove_if(redo.begin(), redo.end(), [compositesBegin, compositesEnd, &redone](int32_t nodeIndex) {
+		if (nodeIndex < compositesBegin || nodeIndex >= compositesEnd || redone[nodeIndex])
+		{
+			return true;
+		}
+		redone[nodeIndex] = true;
+		return false;
+	}), redo.end());
+	for (auto nodeIndex : redo)
+	{
+		moveIndex->RemoveNode(nodeIndex);
+	}
+	// moves into and right after a removed layer are gone; those of them that were valid are now
+	// the same as the move right after the layer before it, which was already valid
+	if (sourceLayerRemoved)
+	{
+		moveIndex->RemoveTarget(sourceLayerId * 2);
+		moveIndex->RemoveTarget(sourceLayerId * 2 + 1);
+		moveIndex->freeLayerIds.push_back(sourceLayerId);
+	}
+	// other nodes only need moves involving the layers whose contents changed rechecked
+	auto &recheckTargetIds = moveIndex->recheckTargetIds;
+	recheckTargetIds.clear();
+	if (!sourceLayerRemoved)
+	{
+		recheckTargetIds.push_back(sourceLayerId * 2);
+	}
+	if (targetLayerId)
+	{
+		recheckTargetIds.push_back(*targetLayerId * 2);
+	}
+	if (newLayerId)
+	{
+		recheckTargetIds.push_back(*newLayerId * 2);
+		recheckTargetIds.push_back(*newLayerId * 2 + 1);
+	}
+	// and only those nodes can go there whose limits include the layer, and as limits are contiguous and
+	// don't change for nodes not redone, those already have a move right before or after it, or they're
+	// skipping those because they're alone in the layer before or after it
+	auto &candidate = moveIndex->candidate;
+	auto &candidates = moveIndex->candidateNodeIndices;
+	candidates.clear();
+	auto addCandidate = [compositesBegin, compositesEnd, &redone, &candidate, &candidates](int32_t nodeIndex) {
+		if (nodeIndex >= compositesBegin && nodeIndex < compositesEnd && !redone[nodeIndex] && !candidate[nodeIndex])
+		{
+			candidate[nodeIndex] = true;
+			candidates.push_back(nodeIndex);
+		}
+	};
+	auto addTargetCandidates = [this, &addCandidate](int32_t layerIndex2) {
+		auto targetId = moveIndex->LayerIndex2Target(layerIndex2);
+		if (targetId < int32_t(moveIndex->targetEntries.size()))
+		{
+			for (auto entryIndex : moveIndex->targetEntries[targetId])
+			{
+				addCandidate(moveIndex->entries[entryIndex].nodeIndex);
+			}
+		}
+	};
+	for (auto recheckTargetId : recheckTargetIds)
+	{
+		if (recheckTargetId & 1)
+		{
+			continue;
+		}
+		auto layerIndex = moveIndex->layerIndices[recheckTargetId / 2];
+		addTargetCandidates(layerIndex * 2 - 1);
+		addTargetCandidates(layerIndex * 2);
+		addTargetCandidates(layerIndex * 2 + 1);
+		for (auto otherLayerIndex : { layerIndex - 1, layerIndex + 1 })
+		{
+			if (otherLayerIndex >= 0 && otherLayerIndex < LayerCount() && LayerSize(otherLayerIndex) == 1)
+			{
+				addCandidate(LayerNodes(otherLayerIndex)[0]);
+			}
+		}
+	}
+	auto &recheckEntryIndices = moveIndex->recheckEntryIndices;
+	if (recheckEntryIndices.size() < recheckTargetIds.size())
+	{
+		recheckEntryIndices.resize(recheckTargetIds.size(), std::vector<int32_t>(design->nodes.size(), -1));
+	}
+	auto fillRecheckEntryIndices = [this, &recheckTargetIds, &recheckEntryIndices](bool fill) {
+		for (int32_t recheckIndex = 0; recheckIndex < int32_t(recheckTargetIds.size()); ++recheckIndex)
+		{
+			auto targetId = recheckTargetIds[recheckIndex];
+			if (targetId < int32_t(moveIndex->targetEntries.size()))
+			{
+				for (auto entryIndex : moveIndex->targetEntries[targetId])
+				{
+					recheckEntryIndices[recheckIndex][moveIndex->entries[entryIndex].nodeIndex] = fill ? entryIndex : -1;
+				}
+			}
+		}
+	};
+	fillRecheckEntryIndices(true);
+	auto &removeEntryIndices = moveIndex->removeEntryIndices;
+	removeEntryIndices.clear();
+	for (auto nodeIndex : redo)
+	{
+		AddNodeMoves(nodeIndex);
+	}
+	for (auto nodeIndex : candidates)
+	{
+		auto moveLimits = GetMoveLimits(nodeIndex);
+		for (int32_t recheckIndex = 0; recheckIndex < int32_t(recheckTargetIds.size()); ++recheckIndex)
+		{
+			auto targetId = recheckTargetIds[recheckIndex];
+			Move move{ nodeIndex, moveIndex->TargetLayerIndex2(targetId) };
+			auto valid = MoveValid(move, moveLimits);
+			auto entryIndex = recheckEntryIndices[recheckIndex][nodeIndex];
+			if (valid && entryIndex == -1)
+			{
+				moveIndex->Add(nodeIndex, targetId);
+			}
+			if (!valid && entryIndex != -1)
+			{
+				removeEntryIndices.push_back(entryIndex);
+			}
+		}
+	}
+	// nothing has been removed yet, so this finds every node filled in above
+	fillRecheckEntryIndices(false);
+	for (auto nodeIndex : redo)
+	{
+		redone[nodeIndex] = false;
+	}
+	for (auto nodeIndex : candidates)
+	{
+		candidate[nodeIndex] = false;
+	}
+	// removing an entry moves the last one into its place, so remove from the back to keep the rest valid
+	std::sort(removeEntryIndices.begin(), removeEntryIndices.end(), std::greater<int32_t>());
+	for (auto entryIndex : removeEntryIndices)
+	{
+		moveIndex->Remove(entryIndex);
+	}
+	CheckMoveIndex();
+}
+
+void State::CheckMoveIndex() const
+{
+#ifdef SPAGHETTI_CHECK_MOVE_INDEX
+	auto indexed = moveIndex->Moves();
+	auto enumerated = ValidMoves();
+	auto moveLess = [](const Move &lhs, const Move &rhs) {
+		return std::pair(lhs.nodeIndex, lhs.layerIndex2) < std::pair(rhs.nodeIndex, rhs.layerIndex2);
+	};
+	std::sort(indexed.begin(), indexed.end(), moveLess);
+	std::sort(enumerated.begin(), enumerated.end(), moveLess);
+	if (!std::equal(indexed.begin(), indexed.end(), enumerated.begin(), enumerated.end(), [](const Move &lhs, const Move &rhs) {
+		return lhs.nodeIndex == rhs.nodeIndex && lhs.layerIndex2 == rhs.layerIndex2;
+	}))
+	{
+		throw MoveIndexMismatch("move index differs from valid moves");
+	}
+#endif
+}
+
+std::shared_ptr<State> State::RandomNeighbour(std::mt19937_64 &rng, Proposal proposal, const MoveKindWeights &moveKindWeights) const
+{
+	auto moveKind = proposal == proposalIndex ? moveSingle : RandomMoveKind(rng, moveKindWeights);
+	if (moveKind != moveSingle)
+	{
+		auto neighbour = std::make_shared<State>();
+		neighbour->iteration = iteration;
+		neighbour->design = design;
+		neighbour->layerBlocks = layerBlocks;
+		neighbour->nodeLayerIndices = nodeLayerIndices;
+		neighbour->operandsSwapped = operandsSwapped;
+		// the state itself if the move drawn isn't valid, same as when there are no moves at all
+		neighbour->ApplyCompoundMove(rng, moveKind);
+		neighbour->ForgetMoves();
+		return neighbour;
+	}
+	auto move = RandomMove(rng, proposal);
+	if (!move)
+	{
+		return std::make_shared<State>(*this);
+	}
+	return Neighbour(*move);
+}
+
+std::optional<Move> State::RandomMove(std::mt19937_64 &rng, Proposal proposal) const
+{
+	if (proposal == proposalIndex && moveIndex)
+	{
+		assert(int32_t(moveIndex->layerIds.size()) == LayerCount());
+		return moveIndex->RandomMove(rng);
+	}
+	// guided proposals need an EnergyTracker, see OptimizeOnce; without one they're just uniform
+	if (proposal == proposalRejection || proposal == proposalGuided)
+	{
+		// every composite and layerIndex2 pair is drawn with the same probability and invalid ones are dropped,
+		// so valid moves come up with the same probability, exactly as when picking one of ValidMoves
+		auto layerIndex2Count = LayerCount() * 2 - 3;
+		auto maxAttempts = int64_t(design->compositeCount) * layerIndex2Count;
+		for (int64_t attemptIndex = 0; attemptIndex < maxAttempts; ++attemptIndex)
+		{
+			auto nodeIndex = design->constantCount + design->inputCount + int32_t(rng() % design->compositeCount);
+			Move move{ nodeIndex, 1 + int32_t(rng() % layerIndex2Count) };
+			if (MoveInWindow(move) && MoveValid(move, GetMoveLimits(nodeIndex)))
+			{
+				return move;
+			}
+		}
+		// there may not be any valid moves at all, enumerating them settles it; the fallback
+		// doesn't depend on which candidates were drawn, so it doesn't skew the distribution
+	}
+	auto moves = ValidMoves();
+	if (!moves.size())
+	{
+		return std::nullopt;
+	}
+	return moves[rng() % moves.size()];
+}
+
+int32_t State::FirstLayerAffectedBy(const Move &move) const
+{
+	auto currLayerIndex = nodeLayerIndices[move.nodeIndex];
+	// an odd layerIndex2 inserts a new layer after layer layerIndex2 / 2, which itself stays intact
+	return std::min(currLayerIndex, (move.layerIndex2 + 1) / 2);
+}
+
+int32_t State::MoveDirection(const Move &move) const
+{
+	return move.layerIndex2 > nodeLayerIndices[move.nodeIndex] * 2 ? 1 : -1;
+}
+
+int32_t State::PressureDirection(int32_t nodeIndex, int32_t peakLayerIndex) const
+{
+	auto layerIndex = nodeLayerIndices[nodeIndex];
+	// the values live right after the peak layer are the ones produced in or before it and consumed after it
+	auto dir = layerIndex <= peakLayerIndex ? linkDownstream : linkUpstream;
+	return std::visit([this, nodeIndex, peakLayerIndex, dir](auto &flat) {
+		for (int32_t linkEnd = flat.linkBegins[dir][nodeIndex]; linkEnd < flat.linkBegins[dir][nodeIndex + 1]; ++linkEnd)
+		{
+			auto linkedLayerIndex = nodeLayerIndices[flat.linkedNodeIndices[dir][linkEnd]];
+			if (dir == linkDownstream && linkedLayerIndex > peakLayerIndex)
+			{
+				return 1;
+			}
+			if (dir == linkUpstream && linkedLayerIndex <= peakLayerIndex)
+			{
+				return -1;
+			}
+		}
+		return 0;
+	}, design->flat);
+}
+
+void PressureNodeSet::Set(int32_t nodeIndex, bool inSet)
+{
+	auto offset = offsets[nodeIndex];
+	if ((offset != -1) == inSet)
+	{
+		return;
+	}
+	undoLog.push_back({ nodeIndex, !inSet });
+	if (inSet)
+	{
+		offsets[nodeIndex] = int32_t(nodeIndices.size());
+		nodeIndices.push_back(nodeIndex);
+	}
+	else
+	{
+		nodeIndices[offset] = nodeIndices.back();
+		offsets[nodeIndices.back()] = offset;
+		nodeIndices.pop_back();
+		offsets[nodeIndex] = -1;
+	}
+}
+
+void PressureNodeSet::Undo()
+{
+	while (undoLog.size())
+	{
+		auto [ nodeIndex, inSet ] = undoLog.back();
+		Set(nodeIndex, inSet);
+		// Set logged this too
+		undoLog.pop_back();
+		undoLog.pop_back();
+	}
+}
+
+void State::PressureNodes(int32_t peakLayerIndex, PressureNodeSet &pressureNodes) const
+{
+	for (auto nodeIndex : pressureNodes.nodeIndices)
+	{
+		pressureNodes.offsets[nodeIndex] = -1;
+	}
+	pressureNodes.nodeIndices.clear();
+	pressureNodes.undoLog.clear();
+	pressureNodes.offsets.resize(design->nodes.size(), -1);
+	if (peakLayerIndex == -1)
+	{
+		return;
+	}
+	for (int32_t compositeIndex = 0; compositeIndex < design->compositeCount; ++compositeIndex)
+	{
+		auto nodeIndex = design->constantCount + design->inputCount + compositeIndex;
+		if (PressureDirection(nodeIndex, peakLayerIndex))
+		{
+			pressureNodes.offsets[nodeIndex] = int32_t(pressureNodes.nodeIndices.size());
+			pressureNodes.nodeIndices.push_back(nodeIndex);
+		}
+	}
+}
+
+bool State::UpdatePressureNodes(int32_t movedNodeIndex, int32_t peakLayerIndex, PressureNodeSet &pressureNodes) const
+{
+	auto &undo = undoLog.back();
+	auto targetLayerAdded = LayerSize(undo.targetLayerIndex) == 1;
+	if ((undo.sourceLayerRemoved && undo.sourceLayerIndex <= peakLayerIndex) || (targetLayerAdded && undo.targetLayerIndex <= peakLayerIndex))
+	{
+		return false;
+	}
+	auto compositesBegin = design->constantCount + design->inputCount;
+	auto compositesEnd = compositesBegin + design->compositeCount;
+	// the direction of a node only depends on which side of the peak it and the nodes linked to it are
+	auto update = [this, peakLayerIndex, &pressureNodes, compositesBegin, compositesEnd](int32_t nodeIndex) {
+		if (nodeIndex >= compositesBegin && nodeIndex < compositesEnd)
+		{
+			pressureNodes.Set(nodeIndex, peakLayerIndex != -1 && PressureDirection(nodeIndex, peakLayerIndex));
+		}
+	};
+	update(movedNodeIndex);
+	std::visit([movedNodeIndex, &update](auto &flat) {
+		for (auto dir = LinkDirection(0); dir < linkMax; dir = LinkDirection(int32_t(dir) + 1))
+		{
+			for (int32_t linkEnd = flat.linkBegins[dir][movedNodeIndex]; linkEnd < flat.linkBegins[dir][movedNodeIndex + 1]; ++linkEnd)
+			{
+				update(flat.linkedNodeIndices[dir][linkEnd]);
+			}
+		}
+	}, design->flat);
+	return true;
+}
+
+std::optional<Move> State::GuidedMove(std::mt19937_64 &rng, int32_t peakLayerIndex, const std::vector<int32_t> &pressureNodeIndices, std::vector<Move> &nodeMoves) const
+{
+	if (!design->compositeCount)
+	{
+		return std::nullopt;
+	}
+	std::uniform_real_distribution<double> rdist(0.0, 1.0);
+	auto guided = !pressureNodeIndices.empty() && rdist(rng) < guidedShare;
+	int32_t nodeIndex;
+	if (guided)
+	{
+		nodeIndex = pressureNodeIndices[rng() % pressureNodeIndices.size()];
+	}
+	else
+	{
+		nodeIndex = design->constantCount + design->inputCount + int32_t(rng() % design->compositeCount);
+	}
+	// all of them, for GuidedMoveProbability
+	nodeMoves.clear();
+	NodeValidMoves(nodeIndex, nodeMoves);
+	if (guided)
+	{
+		auto direction = PressureDirection(nodeIndex, peakLayerIndex);
+		auto isInDirection = [this, direction](const Move &move) {
+			return MoveDirection(move) == direction;
+		};
+		auto directionMoveCount = std::count_if(nodeMoves.begin(), nodeMoves.end(), isInDirection);
+		if (!directionMoveCount)
+		{
+			return std::nullopt;
+		}
+		auto pick = int64_t(rng() % directionMoveCount);
+		return *std::find_if(nodeMoves.begin(), nodeMoves.end(), [&isInDirection, &pick](const Move &move) {
+			return isInDirection(move) && !pick--;
+		});
+	}
+	if (nodeMoves.empty())
+	{
+		// counts as a proposal of the state itself
+		return std::nullopt;
+	}
+	return nodeMoves[rng() % nodeMoves.size()];
+}
+
+double State::GuidedMoveProbability(int32_t nodeIndex, int32_t direction, int32_t peakLayerIndex, int32_t pressureNodeCount) const
+{
+	auto &moves = guidedMoves;
+	moves.clear();
+	NodeValidMoves(nodeIndex, moves);
+	return GuidedMoveProbability(nodeIndex, direction, peakLayerIndex, pressureNodeCount, moves);
+}
+
+double State::GuidedMoveProbability(int32_t nodeIndex, int32_t direction, int32_t peakLayerIndex, int32_t pressureNodeCount, const std::vector<Move> &moves) const
+{
+	auto directionMoveCount = std::count_if(moves.begin(), moves.end(), [this, direction](const Move &move) {
+		return MoveDirection(move) == direction;
+	});
+	auto share = pressureNodeCount ? guidedShare : 0.0;
+	double probability = 0.0;
+	if (moves.size())
+	{
+		probability += (1.0 - share) / design->compositeCount / double(moves.size());
+	}
+	if (share > 0.0 && directionMoveCount && PressureDirection(nodeIndex, peakLayerIndex) == direction)
 	{
-		if (!stream)
-		{
-			throw StreamFailed("stream failed");
-		}
-		return stream;
+		probability += share / double(pressureNodeCount) / double(directionMoveCount);
 	}
+	return probability;
 }
 
-int32_t State::LayerSize(int32_t layerIndex) const
+std::shared_ptr<State> State::Neighbour(const Move &move) const
 {
-	return LayerBegins(layerIndex + 1) - LayerBegins(layerIndex);
+	auto neighbour = std::make_shared<State>();
+	neighbour->iteration = iteration;
+	neighbour->design = design;
+	// shares every layer the move doesn't change with this state
+	neighbour->layerBlocks = layerBlocks;
+	neighbour->nodeLayerIndices = nodeLayerIndices;
+	neighbour->operandsSwapped = operandsSwapped;
+	neighbour->ApplyMove(move);
+	neighbour->ForgetMoves();
+	return neighbour;
 }
 
-std::vector<int32_t> State::InsertNode(int32_t layerIndex, int32_t extraNodeIndex) const
+void State::AssignDetached(const State &other)
 {
-	// we assume that inserting the node into this layer doesn't violate order
-	// we only have to figure out where within the layer it should be inserted
-	auto layerBegin = LayerBegins(layerIndex);
-	auto layerEnd = LayerBegins(layerIndex + 1);
-	auto &extraNode = design->nodes[extraNodeIndex];
-	auto nodeIndicesCopy = std::vector(nodeIndices.begin() + layerBegin, nodeIndices.begin() + layerEnd);
-	// insert up front by default, or at the back if it's a select
-	int32_t insertAt = extraNode.type == Node::select ? nodeIndicesCopy.size() : 0;
-	for (int32_t nodeIndicesIndex = layerBegin; nodeIndicesIndex < layerEnd; ++nodeIndicesIndex)
-	{
-		auto nodeIndex = nodeIndices[nodeIndicesIndex];
-		auto &node = design->nodes[nodeIndex];
-		for (auto dir = LinkDirection(0); dir < linkMax; dir = LinkDirection(int32_t(dir) + 1))
+	iteration = other.iteration;
+	design = other.design;
+	nodeLayerIndices = other.nodeLayerIndices;
+	operandsSwapped = other.operandsSwapped;
+	undoLog.clear();
+	moveIndex.reset();
+	energyCache = std::atomic_load(&other.energyCache);
+	energyWithPlanCache = std::atomic_load(&other.energyWithPlanCache);
+	while (layerBlocks.size() > other.layerBlocks.size())
+	{
+		// spare layers are expected to be empty, see AttachNode
+		layerBlocks.back()->nodeIndices.clear();
+		layerBlocks.back()->hash = 0;
+		layerBlocks.back()->orderHash = 0;
+		spareLayerBlocks.push_back(std::move(layerBlocks.back()));
+		layerBlocks.pop_back();
+	}
+	while (layerBlocks.size() < other.layerBlocks.size())
+	{
+		if (spareLayerBlocks.empty())
 		{
-			for (auto linkIndex : node.linkIndices[dir])
-			{
-				auto &link = design->links[linkIndex];
-				if (link.type == Link::toBinary && link.directions[dir].nodeIndex == extraNodeIndex)
-				{
-					// due to the order assumption above, this runs in only one of the dir iterations
-					// not necessarily in only one of the linkIndex iterations, but that problem is handled elsewhere
-					insertAt = (dir == linkUpstream ? nodeIndicesIndex : (nodeIndicesIndex + 1)) - layerBegin;
-				}
-			}
+			layerBlocks.push_back(std::make_shared<LayerBlock>());
+		}
+		else
+		{
+			layerBlocks.push_back(std::move(spareLayerBlocks.back()));
+			spareLayerBlocks.pop_back();
 		}
 	}
-	nodeIndicesCopy.insert(nodeIndicesCopy.begin() + insertAt, extraNodeIndex);
-	return nodeIndicesCopy;
+	for (int32_t layerIndex = 0; layerIndex < LayerCount(); ++layerIndex)
+	{
+		assert(layerBlocks[layerIndex].use_count() == 1);
+		*layerBlocks[layerIndex] = *other.layerBlocks[layerIndex];
+	}
 }
 
-std::vector<int32_t> State::NodeIndexToLayerIndex() const
+void State::DetachNode(int32_t layerIndex, int32_t offset)
 {
-	std::vector<int32_t> nodeIndexToLayerIndex(design->nodes.size());
-	for (int32_t layerIndex = 0; layerIndex < int32_t(layers.size()); ++layerIndex)
+	auto &layerBlock = MutableLayer(layerIndex);
+	auto nodeIndex = layerBlock.nodeIndices[offset];
+	layerBlock.nodeIndices.erase(layerBlock.nodeIndices.begin() + offset);
+	layerBlock.hash ^= design->nodeHashKeys[nodeIndex];
+	layerBlock.orderHash = LayerOrderHash(layerBlock.nodeIndices);
+	if (layerBlock.nodeIndices.empty())
 	{
-		auto layerBegin = LayerBegins(layerIndex);
-		auto layerEnd = LayerBegins(layerIndex + 1);
-		for (int32_t nodeIndicesIndex = layerBegin; nodeIndicesIndex < layerEnd; ++nodeIndicesIndex)
+		spareLayerBlocks.push_back(std::move(layerBlocks[layerIndex]));
+		layerBlocks.erase(layerBlocks.begin() + layerIndex);
+		for (auto laterLayerIndex = layerIndex; laterLayerIndex < LayerCount(); ++laterLayerIndex)
 		{
-			nodeIndexToLayerIndex[nodeIndices[nodeIndicesIndex]] = layerIndex;
+			for (auto laterNodeIndex : LayerNodes(laterLayerIndex))
+			{
+				nodeLayerIndices[laterNodeIndex] -= 1;
+			}
 		}
 	}
-	return nodeIndexToLayerIndex;
 }
 
-std::vector<Move> State::ValidMoves() const
+void State::AttachNode(int32_t nodeIndex, int32_t layerIndex, int32_t offset, bool newLayer)
 {
-	auto nodeIndexToLayerIndex = NodeIndexToLayerIndex();
-	std::vector<Move> moves;
-	for (int32_t compositeIndex = 0; compositeIndex < design->compositeCount; ++compositeIndex)
+	if (newLayer)
 	{
-		auto nodeIndex = design->constantCount + design->inputCount + compositeIndex;
-		auto &node = design->nodes[nodeIndex];
-		auto currLayerIndex = nodeIndexToLayerIndex[nodeIndex];
-		// move it somewhere between before the first and after the last composite layers
-		std::array<int32_t, linkMax> newLayerIndex2Limit = {{ 1, int32_t(layers.size()) * 2 - 3 }};
-		// don't move it to the same layer
-		std::array<int32_t, linkMax> newLayerIndex2Skip = {{ currLayerIndex * 2, currLayerIndex * 2 }};
-		for (auto dir = LinkDirection(0); dir < linkMax; dir = LinkDirection(int32_t(dir) + 1))
+		for (auto laterLayerIndex = layerIndex; laterLayerIndex < LayerCount(); ++laterLayerIndex)
 		{
-			auto sign = dir == linkUpstream ? 1 : -1;
-			for (auto linkIndex : node.linkIndices[dir])
-			{
-				auto &link = design->links[linkIndex];
-				auto linkedNodeIndex = link.directions[dir].nodeIndex;
-				// don't move to layers that are beyond the closest neighbouring nodes
-				newLayerIndex2Limit[dir] = sign * std::max(sign * newLayerIndex2Limit[dir], sign * nodeIndexToLayerIndex[linkedNodeIndex] * 2);
-			}
-			if (LayerSize(currLayerIndex) == 1)
+			for (auto laterNodeIndex : LayerNodes(laterLayerIndex))
 			{
-				// don't move it before or after the same layer either if that layer would just disappear
-				newLayerIndex2Skip[dir] -= sign;
+				nodeLayerIndices[laterNodeIndex] += 1;
 			}
 		}
-		for (int32_t newLayerIndex2 = newLayerIndex2Limit[linkUpstream]; newLayerIndex2 <= newLayerIndex2Limit[linkDownstream]; ++newLayerIndex2)
+		std::shared_ptr<LayerBlock> layerBlock;
+		if (spareLayerBlocks.empty())
 		{
-			if (newLayerIndex2 >= newLayerIndex2Skip[linkUpstream] && newLayerIndex2 <= newLayerIndex2Skip[linkDownstream])
-			{
-				continue;
-			}
-			// make sure we can move it to an existing layer
-			if (!(newLayerIndex2 & 1) && !bool(design->CheckLayer(InsertNode(int32_t(newLayerIndex2 / 2), nodeIndex))))
-			{
-				continue;
-			}
-			moves.push_back({ nodeIndex, newLayerIndex2 });
+			layerBlock = std::make_shared<LayerBlock>();
+		}
+		else
+		{
+			layerBlock = std::move(spareLayerBlocks.back());
+			spareLayerBlocks.pop_back();
 		}
+		layerBlocks.insert(layerBlocks.begin() + layerIndex, std::move(layerBlock));
 	}
-	return moves;
+	auto &layerBlock = MutableLayer(layerIndex);
+	layerBlock.nodeIndices.insert(layerBlock.nodeIndices.begin() + offset, nodeIndex);
+	layerBlock.hash ^= design->nodeHashKeys[nodeIndex];
+	layerBlock.orderHash = LayerOrderHash(layerBlock.nodeIndices);
+	nodeLayerIndices[nodeIndex] = layerIndex;
 }
 
-int32_t State::LayerBegins(int32_t layerIndex) const
+void State::ApplyMove(const Move &move)
 {
-	if (layerIndex == int32_t(layers.size()))
+	assert(!moveIndex);
+	auto sourceLayerIndex = nodeLayerIndices[move.nodeIndex];
+	auto &sourceLayerNodes = LayerNodes(sourceLayerIndex);
+	auto sourceOffset = int32_t(std::find(sourceLayerNodes.begin(), sourceLayerNodes.end(), move.nodeIndex) - sourceLayerNodes.begin());
+	auto sourceLayerRemoved = sourceLayerNodes.size() == 1;
+	// the node goes where InsertNode would put it, or into a new layer
+	auto newLayer = bool(move.layerIndex2 & 1);
+	auto targetLayerIndex = (move.layerIndex2 + 1) / 2;
+	auto targetOffset = newLayer ? 0 : InsertPosition(targetLayerIndex, move.nodeIndex);
+	DetachNode(sourceLayerIndex, sourceOffset);
+	if (sourceLayerRemoved && sourceLayerIndex < targetLayerIndex)
 	{
-		return nodeIndices.size();
+		targetLayerIndex -= 1;
 	}
-	return layers[layerIndex];
+	AttachNode(move.nodeIndex, targetLayerIndex, targetOffset, newLayer);
+	undoLog.push_back({ sourceLayerIndex, sourceOffset, sourceLayerRemoved, targetLayerIndex, targetOffset });
+	iteration += 1;
+	// a state being changed in place is not shared, nobody else can be looking at these
+	energyCache.reset();
+	energyWithPlanCache.reset();
 }
 
-std::shared_ptr<State> State::RandomNeighbour(std::mt19937_64 &rng) const
+void State::UndoMove()
 {
-	auto moves = ValidMoves();
-	if (!moves.size())
+	assert(!undoLog.empty());
+	auto undo = undoLog.back();
+	undoLog.pop_back();
+	if (undo.operandsSwappedNodeIndex != -1)
 	{
-		return std::make_shared<State>(*this);
+		operandsSwapped[undo.operandsSwappedNodeIndex] ^= 1;
+		iteration -= 1;
+		energyCache.reset();
+		energyWithPlanCache.reset();
+		return;
 	}
-	auto move = moves[rng() % moves.size()];
-	auto neighbour = std::make_shared<State>();
-	neighbour->iteration = iteration + 1;
-	neighbour->design = design;
-	auto nodeIndexToLayerIndex = NodeIndexToLayerIndex();
-	for (int32_t layerIndex2 = 0; layerIndex2 < int32_t(layers.size()) * 2; ++layerIndex2)
+	auto nodeIndex = LayerNodes(undo.targetLayerIndex)[undo.targetOffset];
+	DetachNode(undo.targetLayerIndex, undo.targetOffset);
+	AttachNode(nodeIndex, undo.sourceLayerIndex, undo.sourceOffset, undo.sourceLayerRemoved);
+	iteration -= 1;
+	energyCache.reset();
+	energyWithPlanCache.reset();
+}
+
+void State::ReorderNode(int32_t layerIndex, int32_t offset, int32_t newOffset)
+{
+	auto nodeIndex = LayerNodes(layerIndex)[offset];
+	DetachNode(layerIndex, offset);
+	AttachNode(nodeIndex, layerIndex, newOffset, false);
+	undoLog.push_back({ layerIndex, offset, false, layerIndex, newOffset });
+	iteration += 1;
+	energyCache.reset();
+	energyWithPlanCache.reset();
+}
+
+void State::SwapOperands(int32_t nodeIndex)
+{
+	operandsSwapped[nodeIndex] ^= 1;
+	undoLog.push_back({ 0, 0, false, 0, 0, nodeIndex });
+	iteration += 1;
+	energyCache.reset();
+	energyWithPlanCache.reset();
+}
+
+void State::UndoMovesTo(size_t undoLogSize)
+{
+	while (undoLog.size() > undoLogSize)
 	{
-		if (layerIndex2 & 1)
+		UndoMove();
+	}
+}
+
+bool State::ChainedTo(int32_t nodeIndex, int32_t nextNodeIndex) const
+{
+	return std::visit([nodeIndex, nextNodeIndex](auto &flat) {
+		for (int32_t linkEnd = flat.linkBegins[linkDownstream][nodeIndex]; linkEnd < flat.linkBegins[linkDownstream][nodeIndex + 1]; ++linkEnd)
 		{
-			if (layerIndex2 == move.layerIndex2)
+			if (flat.sameLayerRules[linkDownstream][linkEnd] == sameLayerChain && flat.linkedNodeIndices[linkDownstream][linkEnd] == nextNodeIndex)
 			{
-				neighbour->layers.push_back(int32_t(neighbour->nodeIndices.size()));
-				neighbour->nodeIndices.push_back(move.nodeIndex);
+				return true;
 			}
 		}
-		else
-		{
-			auto layerIndex = int32_t(layerIndex2 / 2);
-			auto layerBegin = LayerBegins(layerIndex);
-			auto layerEnd = LayerBegins(layerIndex + 1);
-			if (nodeIndexToLayerIndex[move.nodeIndex] == layerIndex)
-			{
-				if (LayerSize(layerIndex) > 1)
-				{
-					neighbour->layers.push_back(int32_t(neighbour->nodeIndices.size()));
-					for (auto nodeIndicesIndex = layerBegin; nodeIndicesIndex < layerEnd; ++nodeIndicesIndex)
-					{
-						auto nodeIndex = nodeIndices[nodeIndicesIndex];
-						if (nodeIndex != move.nodeIndex)
-						{
-							neighbour->nodeIndices.push_back(nodeIndex);
-						}
-					}
-				}
-			}
-			else
+		return false;
+	}, design->flat);
+}
+
+bool State::PlacementValid(int32_t nodeIndex) const
+{
+	auto layerIndex = nodeLayerIndices[nodeIndex];
+	for (auto dir = LinkDirection(0); dir < linkMax; dir = LinkDirection(int32_t(dir) + 1))
+	{
+		auto sign = dir == linkUpstream ? 1 : -1;
+		auto valid = std::visit([this, nodeIndex, layerIndex, dir, sign](auto &flat) {
+			for (int32_t linkEnd = flat.linkBegins[dir][nodeIndex]; linkEnd < flat.linkBegins[dir][nodeIndex + 1]; ++linkEnd)
 			{
-				neighbour->layers.push_back(int32_t(neighbour->nodeIndices.size()));
-				if (layerIndex2 == move.layerIndex2)
+				auto limit = nodeLayerIndices[flat.linkedNodeIndices[dir][linkEnd]] * 2;
+				if (flat.sameLayerRules[dir][linkEnd] == sameLayerForbid)
 				{
-					auto nodeIndicesCopy = InsertNode(layerIndex, move.nodeIndex);
-					neighbour->nodeIndices.insert(neighbour->nodeIndices.end(), nodeIndicesCopy.begin(), nodeIndicesCopy.end());
+					limit += sign;
 				}
-				else
+				if (sign * layerIndex * 2 < sign * limit)
 				{
-					neighbour->nodeIndices.insert(neighbour->nodeIndices.end(), nodeIndices.begin() + layerBegin, nodeIndices.begin() + layerEnd);
+					return false;
 				}
 			}
+			return true;
+		}, design->flat);
+		if (!valid)
+		{
+			return false;
 		}
 	}
-	assert(neighbour->nodeIndices.size() == design->nodes.size());
-	return neighbour;
+	return true;
 }
 
-void EnergyWithPlan::SortSteps()
+std::optional<int32_t> State::ApplyCompoundMove(std::mt19937_64 &rng, MoveKind kind)
 {
-	std::sort(steps.begin(), steps.end(), [](auto &lhs, auto &rhs) {
-		auto layerIndex = [](auto &step) {
-			return std::visit([](auto &thing) {
-				return thing.layerIndex;
-			}, step);
-		};
-		auto lhsLayerIndex = layerIndex(lhs);
-		auto rhsLayerIndex = layerIndex(rhs);
-		if (lhsLayerIndex != rhsLayerIndex)
+	auto compositeLayerCount = LayerCount() - 2;
+	if (!design->compositeCount || compositeLayerCount < 1)
+	{
+		return std::nullopt;
+	}
+	auto undoLogSize = undoLog.size();
+	auto firstLayerIndex = LayerCount();
+	auto &movedNodeIndices = compoundMovedNodeIndices;
+	movedNodeIndices.clear();
+	// steps may pass through states that aren't valid, only the end result is checked
+	auto step = [this, &firstLayerIndex, &movedNodeIndices](Move move) {
+		firstLayerIndex = std::min(firstLayerIndex, FirstLayerAffectedBy(move));
+		ApplyMove(move);
+		movedNodeIndices.push_back(move.nodeIndex);
+	};
+	auto randomComposite = [this, &rng]() {
+		return design->constantCount + design->inputCount + int32_t(rng() % design->compositeCount);
+	};
+	switch (kind)
+	{
+	case moveSwap:
 		{
-			return lhsLayerIndex < rhsLayerIndex;
+			auto nodeIndex = randomComposite();
+			auto otherNodeIndex = randomComposite();
+			auto layerIndex = nodeLayerIndices[nodeIndex];
+			auto otherLayerIndex = nodeLayerIndices[otherNodeIndex];
+			if (layerIndex == otherLayerIndex)
+			{
+				return std::nullopt;
+			}
+			// if the first node leaves its layer empty, the second one gets a new layer in its place
+			auto layerRemoved = LayerSize(layerIndex) == 1;
+			step({ nodeIndex, otherLayerIndex * 2 });
+			step({ otherNodeIndex, layerRemoved ? (layerIndex * 2 - 1) : (layerIndex * 2) });
 		}
-		// at this point only order within the layer needs to be established
-		auto layerOrder = [](auto &step) {
-			return std::visit([](auto &thing) {
-				return thing.layerOrder;
-			}, step);
-		};
-		auto lhsLayerOrder = layerOrder(lhs);
-		auto rhsLayerOrder = layerOrder(rhs);
-		if (lhsLayerOrder != rhsLayerOrder)
+		break;
+
+	case moveChain:
 		{
-			return lhsLayerOrder < rhsLayerOrder;
+			auto nodeIndex = randomComposite();
+			auto layerIndex = nodeLayerIndices[nodeIndex];
+			auto &layerNodes = LayerNodes(layerIndex);
+			auto chainBegin = int32_t(std::find(layerNodes.begin(), layerNodes.end(), nodeIndex) - layerNodes.begin());
+			auto chainEnd = chainBegin + 1;
+			while (chainBegin > 0 && ChainedTo(layerNodes[chainBegin - 1], layerNodes[chainBegin]))
+			{
+				chainBegin -= 1;
+			}
+			while (chainEnd < int32_t(layerNodes.size()) && ChainedTo(layerNodes[chainEnd - 1], layerNodes[chainEnd]))
+			{
+				chainEnd += 1;
+			}
+			if (chainEnd - chainBegin < 2)
+			{
+				// plain single moves cover this
+				return std::nullopt;
+			}
+			auto wholeLayer = chainEnd - chainBegin == int32_t(layerNodes.size());
+			auto &chain = compoundNodeIndices;
+			chain.assign(layerNodes.begin() + chainBegin, layerNodes.begin() + chainEnd);
+			auto layerIndex2 = 1 + int32_t(rng() % (LayerCount() * 2 - 3));
+			if (layerIndex2 == layerIndex * 2 || (wholeLayer && (layerIndex2 == layerIndex * 2 - 1 || layerIndex2 == layerIndex * 2 + 1)))
+			{
+				// these would leave the state as it is
+				return std::nullopt;
+			}
+			// the rest of the chain follows the head, InsertPosition puts each node right after the one it's chained to
+			step({ chain[0], layerIndex2 });
+			for (int32_t chainIndex = 1; chainIndex < int32_t(chain.size()); ++chainIndex)
+			{
+				step({ chain[chainIndex], nodeLayerIndices[chain[0]] * 2 });
+			}
 		}
-		if (lhsLayerOrder == Load::layerOrder)
+		break;
+
+	case moveMerge:
 		{
-			// at this point only order among Mode, Load, and Cload needs to be established
-			auto order = [](auto &step) -> std::tuple<int32_t, int32_t, int32_t, int32_t> {
-				if (auto *load = std::get_if<EnergyWithPlan::Load>(&step))
-				{
-					return { -load->tmp, 1, load->storageSlot, 0 };
-				}
-				else if (auto *cload = std::get_if<EnergyWithPlan::Cload>(&step))
-				{
-					return { -cload->tmp, 1, cload->storageSlot, 1 };
-				}
-				else if (auto *mode = std::get_if<EnergyWithPlan::Mode>(&step))
-				{
-					return { -mode->tmp, 0, -1, -1 };
-				}
-				return { -1, -1, -1, -1 };
-			};
-			auto lhsOrder = order(lhs);
-			auto rhsOrder = order(rhs);
-			if (lhsOrder != rhsOrder)
+			if (compositeLayerCount < 2)
+			{
+				return std::nullopt;
+			}
+			auto layerIndex = 1 + int32_t(rng() % (compositeLayerCount - 1));
+			auto &mergedNodeIndices = compoundNodeIndices;
+			mergedNodeIndices = LayerNodes(layerIndex + 1);
+			for (auto nodeIndex : mergedNodeIndices)
 			{
-				return lhsOrder < rhsOrder;
+				step({ nodeIndex, layerIndex * 2 });
 			}
 		}
-		if (lhsLayerOrder == Store::layerOrder)
+		break;
+
+	case moveSplit:
 		{
-			// at this point only order among Store and Cstore needs to be established
-			auto order = [](auto &step) -> std::tuple<int32_t, int32_t> {
-				if (auto *store = std::get_if<EnergyWithPlan::Store>(&step))
-				{
-					return { store->storageSlot, 1 };
-				}
-				else if (auto *cstore = std::get_if<EnergyWithPlan::Cstore>(&step))
-				{
-					return { cstore->storageSlot, 0 };
-				}
-				return { -1, -1 };
-			};
-			auto lhsOrder = order(lhs);
-			auto rhsOrder = order(rhs);
-			if (lhsOrder != rhsOrder)
+			auto layerIndex = 1 + int32_t(rng() % compositeLayerCount);
+			auto &layerNodes = compoundNodeIndices;
+			layerNodes = LayerNodes(layerIndex);
+			if (layerNodes.size() < 2)
+			{
+				return std::nullopt;
+			}
+			auto splitOffset = 1 + int32_t(rng() % (layerNodes.size() - 1));
+			if (ChainedTo(layerNodes[splitOffset - 1], layerNodes[splitOffset]))
+			{
+				return std::nullopt;
+			}
+			step({ layerNodes[splitOffset], layerIndex * 2 + 1 });
+			for (auto offset = splitOffset + 1; offset < int32_t(layerNodes.size()); ++offset)
 			{
-				return lhsOrder < rhsOrder;
+				step({ layerNodes[offset], (layerIndex + 1) * 2 });
 			}
 		}
-		return false;
-	});
+		break;
+
+	case moveReorder:
+		{
+			auto nodeIndex = randomComposite();
+			auto layerIndex = nodeLayerIndices[nodeIndex];
+			auto &layerNodes = LayerNodes(layerIndex);
+			if (layerNodes.size() < 2)
+			{
+				return std::nullopt;
+			}
+			auto offset = int32_t(std::find(layerNodes.begin(), layerNodes.end(), nodeIndex) - layerNodes.begin());
+			// any other offset, with the same probability
+			auto newOffset = int32_t(rng() % (layerNodes.size() - 1));
+			if (newOffset >= offset)
+			{
+				newOffset += 1;
+			}
+			firstLayerIndex = layerIndex;
+			ReorderNode(layerIndex, offset, newOffset);
+			movedNodeIndices.push_back(nodeIndex);
+		}
+		break;
+
+	case moveOperands:
+		{
+			auto &swappableNodeIndices = design->swappableNodeIndices;
+			if (swappableNodeIndices.empty())
+			{
+				return std::nullopt;
+			}
+			auto nodeIndex = swappableNodeIndices[rng() % swappableNodeIndices.size()];
+			// always valid, CheckLayer lets either operand of a commutative node come from the same layer
+			SwapOperands(nodeIndex);
+			return nodeLayerIndices[nodeIndex];
+		}
+
+	default:
+		assert(false);
+		return std::nullopt;
+	}
+	// layers that only lost nodes stay valid, see GetMoveLimits
+	for (auto nodeIndex : movedNodeIndices)
+	{
+		if (!PlacementValid(nodeIndex) || !design->CheckLayer(LayerNodes(nodeLayerIndices[nodeIndex])))
+		{
+			UndoMovesTo(undoLogSize);
+			return std::nullopt;
+		}
+	}
+	return firstLayerIndex;
 }
 
 std::shared_ptr<Plan> EnergyWithPlan::ToPlan() const
@@ -300,408 +1420,606 @@ std::shared_ptr<Plan> EnergyWithPlan::ToPlan() const
 	constexpr int32_t stackMaxCost       = 1495;
 	constexpr auto    bottomTopCost      = Plan::Bottom::cost + Plan::Top::cost;
 	constexpr auto    stackLayersMaxCost = stackMaxCost - bottomTopCost;
+	constexpr auto    layerOpenCost      = Plan::West::cost + Plan::Clear::cost;
+	constexpr auto    beginStoreCost     = Plan::Aray::cost + Plan::East::cost;
 	auto plan = std::make_shared<Plan>();
+	plan->steps.reserve(steps.size() + design->storageSlots + design->workSlots);
 	int32_t lsnsLife3Index = -1;
 	std::vector<int32_t> constantValue(design->storageSlots, 0);
+	// constants are all in layer 0
 	for (auto &step : steps)
 	{
-		if (auto *constant = std::get_if<Constant>(&step))
+		if (std::get_if<Commit>(&step))
+		{
+			break;
+		}
+		if (auto *constant = std::get_if<Constant>(&step))
+		{
+			constantValue[constant->storageSlot] = constant->value;
+			if (constant->value == lsnsLife3Value)
+			{
+				lsnsLife3Index = constant->storageSlot;
+			}
+		}
+	}
+	plan->steps.push_back(Plan::Lcap{ { 0 }, lsnsLife3Index });
+	int32_t stackIndex = 0;
+	for (int32_t storageSlotIndex = 0; storageSlotIndex < design->storageSlots; ++storageSlotIndex)
+	{
+		plan->steps.push_back(Plan::Rfilt{ { stackIndex }, storageSlotIndex, constantValue[storageSlotIndex] });
+	}
+	for (int32_t workSlotIndex = 0; workSlotIndex < design->workSlots; ++workSlotIndex)
+	{
+		plan->steps.push_back(Plan::Lfilt{ { stackIndex }, workSlotIndex });
+	}
+	auto toPlanStep = [&stackIndex](const Step &step) -> std::optional<Plan::Step> {
+		if (auto *load = std::get_if<Load>(&step))
+		{
+			return Plan::Load{ { stackIndex }, load->workSlot, load->storageSlot };
+		}
+		else if (auto *cload = std::get_if<Cload>(&step))
+		{
+			return Plan::Cload{ { stackIndex }, cload->workSlot };
+		}
+		else if (auto *store = std::get_if<Store>(&step))
+		{
+			return Plan::Store{ { stackIndex }, store->workSlot, store->storageSlot };
+		}
+		else if (auto *cstore = std::get_if<Cstore>(&step))
+		{
+			return Plan::Cstore{ { stackIndex }, cstore->workSlot, cstore->storageSlot };
+		}
+		else if (auto *mode = std::get_if<Mode>(&step))
+		{
+			return Plan::Mode{ { stackIndex }, mode->tmp };
+		}
+		return std::nullopt;
+	};
+	auto isStore = [](const Step &step) {
+		return std::get_if<Store>(&step) || std::get_if<Cstore>(&step);
+	};
+	auto stepCost = [](const Plan::Step &step) {
+		return std::visit([](auto &step) {
+			return step.cost;
+		}, step);
+	};
+	// layers are costed before being emitted so that they can go straight into the plan
+	// instead of being buffered until it's known which stack they end up in
+	int32_t stackCost = 0;
+	auto closeStack = [&plan, &stackIndex, &stackCost]() {
+		if (stackCost)
+		{
+			plan->steps.push_back(Plan::Top{ stackIndex });
+			stackIndex += 1;
+			stackCost = 0;
+		}
+	};
+	auto layerBegin = steps.begin();
+	while (layerBegin != steps.end())
+	{
+		auto layerEnd = std::find_if(layerBegin, steps.end(), [](auto &step) {
+			return bool(std::get_if<Commit>(&step));
+		});
+		int32_t layerCost = 0;
+		auto hasStore = false;
+		for (auto it = layerBegin; it != layerEnd; ++it)
+		{
+			if (auto planStep = toPlanStep(*it))
+			{
+				layerCost += stepCost(*planStep);
+				hasStore |= isStore(*it);
+			}
+		}
+		if (layerCost)
+		{
+			layerCost += layerOpenCost;
+			if (hasStore)
+			{
+				layerCost += beginStoreCost;
+			}
+			assert(layerCost <= stackLayersMaxCost);
+			if (stackCost + layerCost > stackLayersMaxCost)
+			{
+				closeStack();
+			}
+			if (!stackCost)
+			{
+				plan->steps.push_back(Plan::Bottom{ stackIndex });
+			}
+			auto beganStore = false;
+			for (auto it = layerBegin; it != layerEnd; ++it)
+			{
+				if (auto planStep = toPlanStep(*it))
+				{
+					if (!beganStore && isStore(*it))
+					{
+						beganStore = true;
+						plan->steps.push_back(Plan::Aray{ stackIndex });
+						plan->steps.push_back(Plan::East{ stackIndex });
+					}
+					plan->steps.push_back(*planStep);
+				}
+			}
+			plan->steps.push_back(Plan::West{ stackIndex });
+			plan->steps.push_back(Plan::Clear{ stackIndex });
+			stackCost += layerCost;
+		}
+		layerBegin = layerEnd;
+		if (layerBegin != steps.end())
+		{
+			++layerBegin;
+		}
+	}
+	closeStack();
+	for (auto &step : plan->steps)
+	{
+		plan->cost += stepCost(step);
+	}
+	plan->stackCount = stackIndex;
+	return plan;
+}
+
+bool EnergyWorkspace::SlotFree(int32_t slotIndex) const
+{
+	return freeSlots[slotIndex / wordBits] & WordBit(slotIndex);
+}
+
+int32_t EnergyWorkspace::LiveSlotCount() const
+{
+	// bits past slotCount are clear, see ResizeSlots
+	auto liveSlotCount = slotCount;
+	for (int32_t wordIndex = 0; wordIndex < WordCount(slotCount); ++wordIndex)
+	{
+		liveSlotCount -= PopCount(freeSlots[wordIndex]);
+	}
+	return liveSlotCount;
+}
+
+void EnergyWorkspace::ResizeSlots(int32_t newSlotCount)
+{
+	if (int32_t(freeSlots.size()) < WordCount(newSlotCount))
+	{
+		freeSlots.resize(WordCount(newSlotCount), 0);
+	}
+	// slots being added are free, slots being removed are free and get cleared to keep the bits past slotCount clear
+	for (int32_t slotIndex = slotCount; slotIndex < newSlotCount; ++slotIndex)
+	{
+		freeSlots[slotIndex / wordBits] |= WordBit(slotIndex);
+	}
+	for (int32_t slotIndex = newSlotCount; slotIndex < slotCount; ++slotIndex)
+	{
+		assert(SlotFree(slotIndex));
+		freeSlots[slotIndex / wordBits] &= ~WordBit(slotIndex);
+	}
+	slotCount = newSlotCount;
+}
+
+void EnergyWorkspace::PlanChains::Push(int32_t key, const EnergyWithPlan::Step &step)
+{
+	auto entryIndex = int32_t(entries.size());
+	entries.push_back({ step, -1 });
+	if (int32_t(keys.size()) < WordCount(key + 1))
+	{
+		keys.resize(WordCount(key + 1), 0);
+		ends.resize(keys.size() * wordBits);
+	}
+	auto &keyWord = keys[key / wordBits];
+	if (keyWord & WordBit(key))
+	{
+		entries[ends[key].second].next = entryIndex;
+		ends[key].second = entryIndex;
+	}
+	else
+	{
+		keyWord |= WordBit(key);
+		ends[key] = { entryIndex, entryIndex };
+	}
+}
+
+template<class Func>
+void EnergyWorkspace::PlanChains::Drain(Func &&func)
+{
+	if (entries.empty())
+	{
+		return;
+	}
+	for (int32_t wordIndex = 0; wordIndex < int32_t(keys.size()); ++wordIndex)
+	{
+		auto keyWord = keys[wordIndex];
+		while (keyWord)
 		{
-			constantValue[constant->storageSlot] = constant->value;
-			if (constant->value == lsnsLife3Value)
+			auto key = wordIndex * wordBits + CountTrailingZeros(keyWord);
+			for (auto entryIndex = ends[key].first; entryIndex != -1; entryIndex = entries[entryIndex].next)
 			{
-				lsnsLife3Index = constant->storageSlot;
+				func(entries[entryIndex].step);
 			}
+			keyWord &= keyWord - 1;
 		}
+		keys[wordIndex] = 0;
 	}
-	plan->steps.push_back(Plan::Lcap{ { 0 }, lsnsLife3Index });
-	struct Buffer
+	entries.clear();
+}
+
+void EnergyWorkspace::PushPlanStep(const EnergyWithPlan::Step &step)
+{
+	// Mode goes before loads with the same tmp, Cstore goes before Store to the same storage slot
+	if (auto *mode = std::get_if<EnergyWithPlan::Mode>(&step))
 	{
-		std::vector<Plan::Step> steps;
-		int32_t cost = 0;
-	};
-	Buffer stackBuffer;
-	Buffer layerBuffer;
-	auto pushToBuffer = [](Buffer &buffer, Plan::Step step) {
-		buffer.steps.push_back(step);
-		buffer.cost += std::visit([](auto &step) {
-			return step.cost;
+		planLoads[mode->tmp].Push(0, step);
+	}
+	else if (auto *load = std::get_if<EnergyWithPlan::Load>(&step))
+	{
+		planLoads[load->tmp].Push(load->storageSlot + 1, step);
+	}
+	else if (auto *cload = std::get_if<EnergyWithPlan::Cload>(&step))
+	{
+		planLoads[cload->tmp].Push(cload->storageSlot + 1, step);
+	}
+	else if (auto *store = std::get_if<EnergyWithPlan::Store>(&step))
+	{
+		planStores.Push(store->storageSlot * 2 + 1, step);
+	}
+	else if (auto *cstore = std::get_if<EnergyWithPlan::Cstore>(&step))
+	{
+		planStores.Push(cstore->storageSlot * 2, step);
+	}
+	else
+	{
+		auto layerOrder = std::visit([](auto &thing) {
+			return thing.layerOrder;
 		}, step);
+		planSteps[layerOrder].push_back(step);
+	}
+}
+
+void EnergyWorkspace::CommitPlanLayer(EnergyWithPlan &energy, int32_t layerIndex)
+{
+	auto emit = [&energy](const EnergyWithPlan::Step &step) {
+		energy.steps.push_back(step);
 	};
-	int32_t stackIndex = 0;
-	auto flushStack = [&stackBuffer, &plan, &stackIndex]() {
-		if (stackBuffer.cost)
-		{
-			plan->steps.push_back(Plan::Bottom{ stackIndex });
-			plan->steps.insert(plan->steps.end(), stackBuffer.steps.begin(), stackBuffer.steps.end());
-			plan->steps.push_back(Plan::Top{ stackIndex });
-			stackIndex += 1;
-			stackBuffer = {};
-		}
-	};
-	auto pushToLayer = [&layerBuffer, &pushToBuffer](Plan::Step step) {
-		pushToBuffer(layerBuffer, step);
-	};
-	auto layerOpen = false;
-	auto beganStore = false;
-	auto flushLayer = [&stackIndex, &beganStore, &layerOpen, &pushToLayer, &stackBuffer, &layerBuffer, &flushStack]() {
-		if (layerOpen)
+	for (int32_t layerOrder = 0; layerOrder < EnergyWithPlan::layerOrderCount; ++layerOrder)
+	{
+		auto &bucket = planSteps[layerOrder];
+		energy.steps.insert(energy.steps.end(), bucket.begin(), bucket.end());
+		bucket.clear();
+		if (layerOrder == EnergyWithPlan::Load::layerOrder)
 		{
-			layerOpen = false;
-			beganStore = false;
-			pushToLayer(Plan::West{ stackIndex });
-			pushToLayer(Plan::Clear{ stackIndex });
-			assert(layerBuffer.cost <= stackLayersMaxCost);
-			if (stackBuffer.cost + layerBuffer.cost > stackLayersMaxCost)
+			// higher tmps first
+			for (int32_t tmp = tmpCount - 1; tmp >= 0; --tmp)
 			{
-				flushStack();
+				planLoads[tmp].Drain(emit);
 			}
-			stackBuffer.steps.insert(stackBuffer.steps.end(), layerBuffer.steps.begin(), layerBuffer.steps.end());
-			stackBuffer.cost += layerBuffer.cost;
-			layerBuffer = {};
 		}
-	};
-	auto beginLayer = [&layerOpen]() {
-		if (!layerOpen)
-		{
-			layerOpen = true;
-		}
-	};
-	auto beginStore = [&beganStore, &stackIndex, &beginLayer, &pushToLayer]() {
-		beginLayer();
-		if (!beganStore)
+		if (layerOrder == EnergyWithPlan::Store::layerOrder)
 		{
-			beganStore = true;
-			pushToLayer(Plan::Aray{ stackIndex });
-			pushToLayer(Plan::East{ stackIndex });
+			planStores.Drain(emit);
 		}
-	};
-	for (int32_t storageSlotIndex = 0; storageSlotIndex < design->storageSlots; ++storageSlotIndex)
-	{
-		plan->steps.push_back(Plan::Rfilt{ { stackIndex }, storageSlotIndex, constantValue[storageSlotIndex] });
 	}
-	for (int32_t workSlotIndex = 0; workSlotIndex < design->workSlots; ++workSlotIndex)
+	energy.steps.push_back(EnergyWithPlan::Commit{ layerIndex });
+}
+
+int32_t EnergyWorkspace::Read(JournalEntry::Target target, int32_t index) const
+{
+	switch (target)
 	{
-		plan->steps.push_back(Plan::Lfilt{ { stackIndex }, workSlotIndex });
+	case JournalEntry::slotFree:
+		return SlotFree(index) ? 1 : 0;
+
+	case JournalEntry::storageUsesLeft:
+		return storage[index].usesLeft;
+
+	case JournalEntry::storageSlotIndex:
+		break;
 	}
-	for (auto &step : steps)
+	return storage[index].slotIndex;
+}
+
+void EnergyWorkspace::Apply(JournalEntry::Target target, int32_t index, int32_t value)
+{
+	switch (target)
 	{
-		if (std::get_if<Commit>(&step))
-		{
-			flushLayer();
-		}
-		else if (auto *load = std::get_if<Load>(&step))
-		{
-			beginLayer();
-			pushToLayer(Plan::Load{ { stackIndex }, load->workSlot, load->storageSlot });
-		}
-		else if (auto *cload = std::get_if<Cload>(&step))
-		{
-			beginLayer();
-			pushToLayer(Plan::Cload{ { stackIndex }, cload->workSlot });
-		}
-		else if (auto *store = std::get_if<Store>(&step))
+	case JournalEntry::slotFree:
+		if (value)
 		{
-			beginStore();
-			pushToLayer(Plan::Store{ { stackIndex }, store->workSlot, store->storageSlot });
+			freeSlots[index / wordBits] |= WordBit(index);
 		}
-		else if (auto *cstore = std::get_if<Cstore>(&step))
-		{
-			beginStore();
-			pushToLayer(Plan::Cstore{ { stackIndex }, cstore->workSlot, cstore->storageSlot });
-		}
-		else if (auto *mode = std::get_if<Mode>(&step))
+		else
 		{
-			beginLayer();
-			pushToLayer(Plan::Mode{ { stackIndex }, mode->tmp });
+			freeSlots[index / wordBits] &= ~WordBit(index);
 		}
+		break;
+
+	case JournalEntry::storageUsesLeft:
+		storage[index].usesLeft = value;
+		break;
+
+	case JournalEntry::storageSlotIndex:
+		storage[index].slotIndex = value;
+		break;
 	}
-	flushStack();
-	for (auto &step : plan->steps)
+}
+
+void EnergyWorkspace::Write(JournalEntry::Target target, int32_t index, int32_t value)
+{
+	if (tracking)
 	{
-		std::visit([&plan](auto &step) {
-			plan->cost += step.cost;
-		}, step);
+		journal.push_back({ target, index, Read(target, index), value });
 	}
-	plan->stackCount = stackIndex;
-	return plan;
+	Apply(target, index, value);
 }
 
 template<class EnergyType>
-EnergyType State::GetEnergy() const
+int32_t EnergyWorkspace::AllocStorage(int32_t layerIndex, int32_t sourceIndex, bool forConstant, std::optional<int32_t> freeSlotIndex)
 {
-	EnergyType energy;
-	struct OutputRemap
-	{
-		int32_t from, to;
-	};
-	std::vector<OutputRemap> outputRemaps;
-	auto nodeIndexToLayerIndex = NodeIndexToLayerIndex();
-	struct Storage
-	{
-		int32_t usesLeft = 0;
-		int32_t slotIndex = -1;
-		std::vector<int32_t> outputLinks;
-	};
-	std::vector<std::optional<int32_t>> slots;
-	std::vector<Storage> storage(design->sources.size());
-	std::vector<int32_t> disallowConstantsInSlots(design->storageSlots, 0); // std::vector<bool> is stupid
-	for (auto &outputLink : design->outputLinks)
+	auto &outputStorageSlots = design->sources[sourceIndex].outputStorageSlots;
+	for (auto slotIndex : outputStorageSlots)
 	{
-		storage[outputLink.sourceIndex].outputLinks.push_back(outputLink.storageSlot);
-		disallowConstantsInSlots[outputLink.storageSlot] = 1;
+		if (!freeSlotIndex && (slotIndex >= slotCount || SlotFree(slotIndex)))
+		{
+			freeSlotIndex = slotIndex;
+		}
 	}
-	for (auto clobberStorageSlot : design->clobberStorageSlots)
+	if (freeSlotIndex)
 	{
-		disallowConstantsInSlots[clobberStorageSlot] = 1;
-	}
-	auto allocStorage = [
-		this,
-		&outputRemaps,
-		&energy,
-		&storage,
-		&disallowConstantsInSlots,
-		&slots
-	](int32_t layerIndex, int32_t sourceIndex, bool forConstant, std::optional<int32_t> freeSlotIndex) {
-		for (auto slotIndex : storage[sourceIndex].outputLinks)
+		auto minSize = *freeSlotIndex + 1;
+		if (slotCount < minSize)
 		{
-			if (!*freeSlotIndex && !slots[slotIndex])
-			{
-				freeSlotIndex = slotIndex;
-			}
+			ResizeSlots(minSize);
 		}
-		if (freeSlotIndex)
+	}
+	auto &disallowConstantsInSlots = design->disallowConstantsInSlots;
+	if (!freeSlotIndex)
+	{
+		// first fit
+		for (int32_t wordIndex = 0; wordIndex < WordCount(slotCount); ++wordIndex)
 		{
-			auto minSize = *freeSlotIndex + 1;
-			if (int32_t(slots.size()) < minSize)
+			auto word = freeSlots[wordIndex];
+			if (forConstant && wordIndex < int32_t(disallowConstantsInSlots.size()))
 			{
-				slots.resize(minSize);
+				word &= ~disallowConstantsInSlots[wordIndex];
 			}
-		}
-		auto slotOk = [&slots, &disallowConstantsInSlots, forConstant](int32_t slotIndex) {
-			return !slots[slotIndex] && !(forConstant && slotIndex < int32_t(disallowConstantsInSlots.size()) && disallowConstantsInSlots[slotIndex]);
-		};
-		if (!freeSlotIndex)
-		{
-			for (int32_t slotIndex = 0; slotIndex < int32_t(slots.size()); ++slotIndex)
+			if (word)
 			{
-				if (slotOk(slotIndex))
-				{
-					freeSlotIndex = slotIndex;
-					break;
-				}
+				freeSlotIndex = wordIndex * wordBits + CountTrailingZeros(word);
+				break;
 			}
 		}
-		while (!freeSlotIndex)
+	}
+	if (!freeSlotIndex)
+	{
+		auto tryNext = slotCount;
+		while (forConstant && tryNext / wordBits < int32_t(disallowConstantsInSlots.size()) && (disallowConstantsInSlots[tryNext / wordBits] & WordBit(tryNext)))
 		{
-			auto tryNext = slots.size();
-			slots.emplace_back();
-			if (slotOk(tryNext))
-			{
-				freeSlotIndex = tryNext;
-			}
+			tryNext += 1;
 		}
-		assert(!slots[*freeSlotIndex]);
-		slots[*freeSlotIndex] = sourceIndex; // outputRemaps
-		for (auto slotIndex : storage[sourceIndex].outputLinks)
+		ResizeSlots(tryNext + 1);
+		freeSlotIndex = tryNext;
+	}
+	assert(SlotFree(*freeSlotIndex));
+	Write(JournalEntry::slotFree, *freeSlotIndex, 0);
+	if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
+	{
+		for (auto slotIndex : outputStorageSlots)
 		{
 			if (slotIndex != *freeSlotIndex)
 			{
 				outputRemaps.push_back({ *freeSlotIndex, slotIndex });
 			}
 		}
-		auto uses = design->sources[sourceIndex].uses;
-		if (forConstant)
-		{
-			uses = -1; // constants have infinite uses
-		}
-		storage[sourceIndex].usesLeft = uses;
-		storage[sourceIndex].slotIndex = *freeSlotIndex;
-		if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
-		{
-			energy.steps.push_back(EnergyWithPlan::AllocStorage{ { layerIndex }, sourceIndex, *freeSlotIndex, uses });
-		}
-		return *freeSlotIndex;
-	};
-	auto useStorage = [&energy, &storage, &slots](int32_t layerIndex, int32_t sourceIndex) {
-		auto slotIndex = storage[sourceIndex].slotIndex;
-		auto &usesLeft = storage[sourceIndex].usesLeft;
-		if (usesLeft != -1)
-		{
-			assert(usesLeft > 0);
-			usesLeft -= 1;
-			if (!usesLeft)
-			{
-				slots[slotIndex] = std::nullopt;
-			}
-		}
-		if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
+	}
+	auto uses = design->sources[sourceIndex].uses;
+	if (forConstant)
+	{
+		uses = -1; // constants have infinite uses
+	}
+	Write(JournalEntry::storageUsesLeft, sourceIndex, uses);
+	Write(JournalEntry::storageSlotIndex, sourceIndex, *freeSlotIndex);
+	if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
+	{
+		PushPlanStep(EnergyWithPlan::AllocStorage{ { layerIndex }, sourceIndex, *freeSlotIndex, uses });
+	}
+	return *freeSlotIndex;
+}
+
+template<class EnergyType>
+int32_t EnergyWorkspace::UseStorage(int32_t layerIndex, int32_t sourceIndex)
+{
+	auto slotIndex = storage[sourceIndex].slotIndex;
+	auto usesLeft = storage[sourceIndex].usesLeft;
+	if (usesLeft != -1)
+	{
+		assert(usesLeft > 0);
+		Write(JournalEntry::storageUsesLeft, sourceIndex, usesLeft - 1);
+		if (usesLeft == 1)
 		{
-			energy.steps.push_back(EnergyWithPlan::UseStorage{ { layerIndex }, slotIndex });
+			Write(JournalEntry::slotFree, slotIndex, 1);
 		}
-		return slotIndex;
-	};
+	}
+	if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
+	{
+		PushPlanStep(EnergyWithPlan::UseStorage{ { layerIndex }, slotIndex });
+	}
+	return slotIndex;
+}
+
+template<class EnergyType>
+void EnergyWorkspace::BeginLayers(const State &state, EnergyType &energy)
+{
+	if (design != state.design)
+	{
+		design = state.design;
+	}
+	storage.assign(design->sources.size(), {});
+	std::fill(freeSlots.begin(), freeSlots.end(), 0);
+	slotCount = 0;
+	outputRemaps.clear();
+	// stamps only ever grow, so stale ones left over from earlier evaluations never match
+	nodeLayerStamps.resize(design->nodes.size(), 0);
+	journal.clear();
+	checkpoints.clear();
 	for (int32_t inputIndex = 0; inputIndex < design->inputCount; ++inputIndex)
 	{
 		auto nodeIndex = design->constantCount + inputIndex;
 		auto &node = design->nodes[nodeIndex];
 		auto sourceIndex = node.sources[0];
-		allocStorage(0, sourceIndex, false, design->inputStorageSlots[inputIndex]);
+		AllocStorage<EnergyType>(0, sourceIndex, false, design->inputStorageSlots[inputIndex]);
 	}
 	for (int32_t constantIndex = 0; constantIndex < design->constantCount; ++constantIndex)
 	{
 		auto nodeIndex = constantIndex;
 		auto &node = design->nodes[nodeIndex];
 		auto sourceIndex = node.sources[0];
-		auto storageSlotIndex = allocStorage(0, sourceIndex, true, std::nullopt);
+		auto storageSlotIndex = AllocStorage<EnergyType>(0, sourceIndex, true, std::nullopt);
 		if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
 		{
-			energy.steps.push_back(EnergyWithPlan::Constant{ { 0 }, storageSlotIndex, design->constantValues[constantIndex] });
+			PushPlanStep(EnergyWithPlan::Constant{ { 0 }, storageSlotIndex, design->constantValues[constantIndex] });
 		}
 	}
 	if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
 	{
-		energy.steps.push_back(EnergyWithPlan::Commit{ 0 });
+		CommitPlanLayer(energy, 0);
+	}
+}
+
+template<class EnergyType>
+void EnergyWorkspace::Layer(const State &state, int32_t layerIndex, EnergyType &energy)
+{
+	auto &layerNodes = state.LayerNodes(layerIndex);
+	layerStamp += 1;
+	if (!layerStamp)
+	{
+		std::fill(nodeLayerStamps.begin(), nodeLayerStamps.end(), 0);
+		layerStamp = 1;
 	}
-	for (int32_t layerIndex = 1; layerIndex < int32_t(layers.size()) - 1; ++layerIndex)
+	for (auto nodeIndex : layerNodes)
 	{
-		struct StoreScheduleEntry
-		{
-			int32_t sourceIndex;
-			int32_t workSlotIndex;
-			std::optional<int32_t> cworkSlotIndex;
-		};
-		std::vector<StoreScheduleEntry> storeSchedule;
-		auto toSelectZeroLinkToSourceIndex = [this](const Link &link) {
-			auto &node = design->nodes[link.directions[linkDownstream].nodeIndex];
-			auto laneIndex = (link.directions[linkDownstream].linkIndicesIndex - 1) / 2;
-			return std::pair<int32_t, int32_t>{ laneIndex, node.sources[laneIndex] };
-		};
-		auto doStore = [&storeSchedule](int32_t workSlotIndex, int32_t sourceIndex) {
+		nodeLayerStamps[nodeIndex] = layerStamp;
+	}
+	auto inLayer = [this](int32_t nodeIndex) {
+		return nodeLayerStamps[nodeIndex] == layerStamp;
+	};
+	storeSchedule.clear();
+	// loads only touch slots allocated in earlier layers, so the slot count can't grow while they happen
+	auto tmpSlotWords = WordCount(slotCount);
+	tmpUsed.fill(0);
+	if (int32_t(tmpSlotUsed.size()) < tmpCount * tmpSlotWords)
+	{
+		tmpSlotUsed.resize(tmpCount * tmpSlotWords);
+	}
+	std::visit([this, &state, &energy, &inLayer, &layerNodes, layerIndex, tmpSlotWords](auto &flat) {
+		auto doStore = [this](int32_t workSlotIndex, int32_t sourceIndex) {
 			auto storeScheduleIndex = int32_t(storeSchedule.size());
 			storeSchedule.push_back({ sourceIndex, workSlotIndex });
 			return storeScheduleIndex;
 		};
-		std::vector<int32_t> selectStorageSlotSchedule;
-		auto doCstore = [&storeSchedule, &toSelectZeroLinkToSourceIndex, &selectStorageSlotSchedule](int32_t workSlotIndex, const Link &link) {
+		// the link is identified by its downstream end, a toSelectZero link's position gives away its lane
+		auto doCstore = [this, &flat](int32_t workSlotIndex, int32_t nodeIndex, int32_t linkIndicesIndex) {
 			auto storeScheduleIndex = int32_t(storeSchedule.size());
-			auto [ laneIndex, sourceIndex ] = toSelectZeroLinkToSourceIndex(link);
+			auto laneIndex = (linkIndicesIndex - 1) / 2;
+			auto sourceIndex = flat.sources[flat.sourceBegins[nodeIndex] + laneIndex];
 			storeSchedule.push_back({ sourceIndex, -1, workSlotIndex });
 			selectStorageSlotSchedule[laneIndex] = storeScheduleIndex;
 		};
-		auto doCstoreStore = [&storeSchedule](int32_t workSlotIndex, int32_t storeScheduleIndex) {
+		auto doCstoreStore = [this](int32_t workSlotIndex, int32_t storeScheduleIndex) {
 			storeSchedule[storeScheduleIndex].workSlotIndex = workSlotIndex;
 		};
-		struct TmpLoad
-		{
-			bool used;
-			std::vector<int32_t> slotUsed; // std::vector<bool> is stupid
-		};
-		std::vector<TmpLoad> tmpLoads(tmpCount, { false, std::vector<int32_t>(slots.size(), 0) });
-		auto doLoad = [&energy, &useStorage, &tmpLoads, layerIndex](int32_t nodeIndex, int32_t workSlotIndex, int32_t sourceIndex, int32_t tmp) {
-			auto storageSlotIndex = useStorage(layerIndex, sourceIndex);
-			if (!tmpLoads[tmp].used)
+		auto doLoad = [this, &energy, tmpSlotWords, layerIndex](int32_t nodeIndex, int32_t workSlotIndex, int32_t sourceIndex, int32_t tmp) {
+			auto storageSlotIndex = UseStorage<EnergyType>(layerIndex, sourceIndex);
+			if (!tmpUsed[tmp])
 			{
 				energy.partCount += Plan::Mode::cost;
 				if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
 				{
-					energy.steps.push_back(EnergyWithPlan::Mode{ { layerIndex }, workSlotIndex, tmp });
+					PushPlanStep(EnergyWithPlan::Mode{ { layerIndex }, workSlotIndex, tmp });
 				}
-				tmpLoads[tmp].used = true;
+				tmpUsed[tmp] = 1;
+				std::fill_n(tmpSlotUsed.begin() + tmp * tmpSlotWords, tmpSlotWords, 0);
 			}
-			if (tmpLoads[tmp].slotUsed[storageSlotIndex])
+			auto &slotUsedWord = tmpSlotUsed[tmp * tmpSlotWords + storageSlotIndex / wordBits];
+			if (slotUsedWord & WordBit(storageSlotIndex))
 			{
 				energy.partCount += Plan::Cload::cost;
 				if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
 				{
-					energy.steps.push_back(EnergyWithPlan::Cload{ { layerIndex }, nodeIndex, tmp, workSlotIndex, storageSlotIndex });
+					PushPlanStep(EnergyWithPlan::Cload{ { layerIndex }, nodeIndex, tmp, workSlotIndex, storageSlotIndex });
 				}
 			}
 			else
 			{
-				tmpLoads[tmp].slotUsed[storageSlotIndex] = 1;
+				slotUsedWord |= WordBit(storageSlotIndex);
 				energy.partCount += Plan::Load::cost;
 				if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
 				{
-					energy.steps.push_back(EnergyWithPlan::Load{ { layerIndex }, nodeIndex, tmp, workSlotIndex, storageSlotIndex });
+					PushPlanStep(EnergyWithPlan::Load{ { layerIndex }, nodeIndex, tmp, workSlotIndex, storageSlotIndex });
 				}
 			}
 		};
-		auto layerBegin = LayerBegins(layerIndex);
-		auto layerEnd = LayerBegins(layerIndex + 1);
 		int32_t workSlotsUsed = 0;
-		auto &lastNode = design->nodes[nodeIndices[layerEnd - 1]];
-		if (lastNode.type == Node::select)
+		auto lastNodeIndex = layerNodes.back();
+		if (flat.nodeTypes[lastNodeIndex] == Node::select)
 		{
-			selectStorageSlotSchedule.resize(lastNode.sources.size(), -1);
+			selectStorageSlotSchedule.assign(flat.SourceCount(lastNodeIndex), -1);
 		}
 		auto doLinkUpstream = [
-			this,
-			&nodeIndexToLayerIndex,
+			&flat,
+			&state,
+			&inLayer,
 			&workSlotsUsed,
 			&doLoad,
-			&doCstore,
-			layerIndex
+			&doCstore
 		](int32_t nodeIndex, int32_t linkIndicesIndex) {
-			auto &node = design->nodes[nodeIndex];
-			auto linkIndex = node.linkIndices[linkUpstream][linkIndicesIndex];
-			auto &link = design->links[linkIndex];
-			auto linkedNodeIndex = link.directions[linkUpstream].nodeIndex;
-			auto &linkedNode = design->nodes[linkedNodeIndex];
-			if (nodeIndexToLayerIndex[linkedNodeIndex] != layerIndex)
+			auto linkBegin = flat.linkBegins[linkUpstream][nodeIndex];
+			auto linkEnd = linkBegin + state.OperandLink(nodeIndex, linkIndicesIndex);
+			auto linkType = flat.linkTypes[linkUpstream][linkEnd];
+			auto linkedNodeIndex = flat.linkedNodeIndices[linkUpstream][linkEnd];
+			if (!inLayer(linkedNodeIndex))
 			{
 				auto loadTmp = 0;
 				auto stageIndex = linkIndicesIndex;
-				if (node.type == Node::select)
+				if (flat.nodeTypes[nodeIndex] == Node::select)
 				{
-					auto laneCount = int32_t(node.sources.size());
+					auto laneCount = flat.SourceCount(nodeIndex);
 					stageIndex -= laneCount * 2;
 				}
-				if (link.type == Link::toBinary && stageIndex == 0)
+				if (linkType == Link::toBinary && stageIndex == 0)
 				{
 					// grab stage 1 tmp if it's coming from the same layer
-					auto linkIndexNext = node.linkIndices[linkUpstream][linkIndicesIndex + 1];
-					auto &linkNext = design->links[linkIndexNext];
-					auto linkedNodeNextIndex = linkNext.directions[linkUpstream].nodeIndex;
-					if (nodeIndexToLayerIndex[linkedNodeNextIndex] == layerIndex)
+					auto linkedNodeNextIndex = flat.linkedNodeIndices[linkUpstream][linkBegin + state.OperandLink(nodeIndex, linkIndicesIndex + 1)];
+					if (inLayer(linkedNodeNextIndex))
 					{
 						stageIndex += 1;
 					}
 				}
-				if (link.type == Link::toBinary && stageIndex > 0)
+				if (linkType == Link::toBinary && stageIndex > 0)
 				{
-					loadTmp = node.tmps[stageIndex - 1];
+					loadTmp = flat.tmps[flat.tmpBegins[nodeIndex] + stageIndex - 1];
 				}
-				doLoad(nodeIndex, workSlotsUsed, linkedNode.sources[link.upstreamOutputIndex], loadTmp);
+				doLoad(nodeIndex, workSlotsUsed, flat.linkSources[linkUpstream][linkEnd], loadTmp);
 				workSlotsUsed += 1;
-				if (link.type == Link::toSelectZero)
+				if (linkType == Link::toSelectZero)
 				{
-					doCstore(workSlotsUsed - 1, link);
+					doCstore(workSlotsUsed - 1, nodeIndex, linkIndicesIndex);
 				}
 			}
 		};
-		for (int32_t nodeIndicesIndex = layerBegin; nodeIndicesIndex < layerEnd; ++nodeIndicesIndex)
+		for (auto nodeIndex : layerNodes)
 		{
-			auto nodeIndex = nodeIndices[nodeIndicesIndex];
-			auto &node = design->nodes[nodeIndex];
-			if (node.type == Node::select)
+			if (flat.nodeTypes[nodeIndex] == Node::select)
 			{
 				// do zeros first so they don't get inserted between the cond input and its same-layer source
-				auto laneCount = int32_t(node.sources.size());
+				auto laneCount = flat.SourceCount(nodeIndex);
 				for (int32_t laneIndex = 0; laneIndex < laneCount; ++laneIndex)
 				{
 					doLinkUpstream(nodeIndex, laneIndex * 2 + 1);
 				};
 			}
 		}
-		for (int32_t nodeIndicesIndex = layerBegin; nodeIndicesIndex < layerEnd; ++nodeIndicesIndex)
+		for (auto nodeIndex : layerNodes)
 		{
-			auto nodeIndex = nodeIndices[nodeIndicesIndex];
-			auto &node = design->nodes[nodeIndex];
-			if (node.type == Node::select)
+			if (flat.nodeTypes[nodeIndex] == Node::select)
 			{
-				auto stageCount = int32_t(node.tmps.size() + 1);
-				auto laneCount = int32_t(node.sources.size());
+				auto stageCount = flat.TmpCount(nodeIndex) + 1;
+				auto laneCount = flat.SourceCount(nodeIndex);
 				for (int32_t stageIndex = 0; stageIndex < stageCount; ++stageIndex)
 				{
 					doLinkUpstream(nodeIndex, laneCount * 2 + stageIndex);
@@ -714,99 +2032,373 @@ EnergyType State::GetEnergy() const
 			}
 			else
 			{
-				for (int32_t linkIndicesIndex = 0; linkIndicesIndex < int32_t(node.linkIndices[linkUpstream].size()); ++linkIndicesIndex)
+				auto linkCount = flat.LinkCount(linkUpstream, nodeIndex);
+				for (int32_t linkIndicesIndex = 0; linkIndicesIndex < linkCount; ++linkIndicesIndex)
 				{
 					doLinkUpstream(nodeIndex, linkIndicesIndex);
 				}
 				auto needsStore = false;
-				for (auto linkIndex : node.linkIndices[linkDownstream])
+				for (int32_t linkEnd = flat.linkBegins[linkDownstream][nodeIndex]; linkEnd < flat.linkBegins[linkDownstream][nodeIndex + 1]; ++linkEnd)
 				{
-					auto &link = design->links[linkIndex];
-					auto linkedNodeIndex = link.directions[linkDownstream].nodeIndex;
-					if (nodeIndexToLayerIndex[linkedNodeIndex] != layerIndex)
+					auto linkedNodeIndex = flat.linkedNodeIndices[linkDownstream][linkEnd];
+					if (!inLayer(linkedNodeIndex))
 					{
 						needsStore = true;
 					}
-					if (nodeIndexToLayerIndex[linkedNodeIndex] == layerIndex && link.type == Link::toSelectZero)
+					if (inLayer(linkedNodeIndex) && flat.linkTypes[linkDownstream][linkEnd] == Link::toSelectZero)
 					{
-						doCstore(workSlotsUsed - 1, link);
+						doCstore(workSlotsUsed - 1, linkedNodeIndex, flat.linkedLinkIndicesIndices[linkDownstream][linkEnd]);
 					}
 				}
 				if (needsStore)
 				{
-					doStore(workSlotsUsed - 1, node.sources[0]);
+					doStore(workSlotsUsed - 1, flat.sources[flat.sourceBegins[nodeIndex]]);
 				}
 			}
 		}
-		for (auto &storeScheduleEntry : storeSchedule)
+	}, design->flat);
+	for (auto &storeScheduleEntry : storeSchedule)
+	{
+		auto storageSlotIndex = AllocStorage<EnergyType>(layerIndex, storeScheduleEntry.sourceIndex, false, std::nullopt);
+		energy.partCount += Plan::Store::cost;
+		if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
+		{
+			PushPlanStep(EnergyWithPlan::Store{ { layerIndex }, storeScheduleEntry.workSlotIndex, storageSlotIndex });
+		}
+		if (storeScheduleEntry.cworkSlotIndex)
 		{
-			auto storageSlotIndex = allocStorage(layerIndex, storeScheduleEntry.sourceIndex, false, std::nullopt);
-			energy.partCount += Plan::Store::cost;
+			energy.partCount += Plan::Cstore::cost;
 			if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
 			{
-				energy.steps.push_back(EnergyWithPlan::Store{ { layerIndex }, storeScheduleEntry.workSlotIndex, storageSlotIndex });
-			}
-			if (storeScheduleEntry.cworkSlotIndex)
-			{
-				energy.partCount += Plan::Cstore::cost;
-				if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
-				{
-					energy.steps.push_back(EnergyWithPlan::Cstore{ { layerIndex }, *storeScheduleEntry.cworkSlotIndex, storageSlotIndex });
-				}
+				PushPlanStep(EnergyWithPlan::Cstore{ { layerIndex }, *storeScheduleEntry.cworkSlotIndex, storageSlotIndex });
 			}
 		}
-		energy.partCount += Plan::commitCost;
-		if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
-		{
-			energy.steps.push_back(EnergyWithPlan::Commit{ layerIndex });
-		}
 	}
-	auto storageSlotCount = int32_t(slots.size());
+	energy.partCount += Plan::commitCost;
+	if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
+	{
+		CommitPlanLayer(energy, layerIndex);
+	}
+}
+
+template<class EnergyType>
+void EnergyWorkspace::EndLayers(const State &state, EnergyType &energy)
+{
+	auto storageSlotCount = slotCount;
 	auto storageSlotOverhead = std::max(0, storageSlotCount - design->storageSlots);
 	energy.linear = double(energy.partCount) + double(storageSlotOverhead) * design->storageSlotOverheadPenalty;
 	energy.storageSlotCount = storageSlotCount;
 	energy.design = design;
 	if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
 	{
-		if (int32_t(outputRemaps.size()) > design->workSlots)
+		if (int32_t(outputRemaps.size()) > design->workSlots)
+		{
+			energy.outputRemapFailed = true;
+		}
+		else if (outputRemaps.size())
+		{
+			auto layerIndex = state.LayerCount() - 1;
+			PushPlanStep(EnergyWithPlan::Mode{ { layerIndex }, 0, 0 });
+			for (int32_t outputRemapIndex = 0; outputRemapIndex < int32_t(outputRemaps.size()); ++outputRemapIndex)
+			{
+				auto &outputRemap = outputRemaps[outputRemapIndex];
+				PushPlanStep(EnergyWithPlan::Load{ { layerIndex }, -1, 0, outputRemapIndex, outputRemap.from });
+				PushPlanStep(EnergyWithPlan::Store{ { layerIndex }, outputRemapIndex, outputRemap.to });
+			}
+			CommitPlanLayer(energy, layerIndex);
+		}
+	}
+}
+
+void EnergyTracker::Rewind(const EnergyWorkspace::Checkpoint &checkpoint)
+{
+	auto &journal = workspace.journal;
+	while (int32_t(journal.size()) > checkpoint.journalSize)
+	{
+		auto &entry = journal.back();
+		workspace.Apply(entry.target, entry.index, entry.oldValue);
+		journal.pop_back();
+	}
+	// slots past the checkpoint's slot count were allocated later and are free again at this point
+	workspace.ResizeSlots(checkpoint.slotCount);
+	energy.partCount = checkpoint.partCount;
+}
+
+EnergyWorkspace::Checkpoint EnergyTracker::MakeCheckpoint() const
+{
+	return { int32_t(workspace.journal.size()), workspace.slotCount, energy.partCount, workspace.LiveSlotCount() };
+}
+
+void EnergyTracker::CopyFrom(int32_t firstLayerIndex, std::vector<EnergyWorkspace::Checkpoint> &checkpoints, std::vector<EnergyWorkspace::JournalEntry> &journal) const
+{
+	auto &workspaceCheckpoints = workspace.checkpoints;
+	auto &workspaceJournal = workspace.journal;
+	checkpoints.assign(workspaceCheckpoints.begin() + firstLayerIndex, workspaceCheckpoints.end());
+	journal.assign(workspaceJournal.begin() + workspaceCheckpoints[firstLayerIndex].journalSize, workspaceJournal.end());
+}
+
+void EnergyTracker::Restore(int32_t firstLayerIndex, const std::vector<EnergyWorkspace::Checkpoint> &checkpoints, const std::vector<EnergyWorkspace::JournalEntry> &journal)
+{
+	auto &workspaceCheckpoints = workspace.checkpoints;
+	Rewind(workspaceCheckpoints[firstLayerIndex]);
+	workspace.ResizeSlots(checkpoints.back().slotCount);
+	for (auto &entry : journal)
+	{
+		workspace.Apply(entry.target, entry.index, entry.newValue);
+		workspace.journal.push_back(entry);
+	}
+	workspaceCheckpoints.resize(firstLayerIndex);
+	workspaceCheckpoints.insert(workspaceCheckpoints.end(), checkpoints.begin(), checkpoints.end());
+	energy.partCount = workspaceCheckpoints.back().partCount;
+}
+
+Energy EnergyTracker::TrackedEnergy() const
+{
+	auto &design = workspace.design;
+	auto storageSlotCount = workspace.slotCount;
+	auto storageSlotOverhead = std::max(0, storageSlotCount - design->storageSlots);
+	Energy result;
+	result.partCount = energy.partCount;
+	result.linear = double(energy.partCount) + double(storageSlotOverhead) * design->storageSlotOverheadPenalty;
+	result.storageSlotCount = storageSlotCount;
+	result.design = design;
+	return result;
+}
+
+Energy EnergyTracker::Reset(const State &state)
+{
+	auto &checkpoints = workspace.checkpoints;
+	energy = {};
+	proposedFrom = -1;
+	workspace.tracking = true;
+	workspace.BeginLayers(state, energy);
+	checkpoints.resize(1); // layer 0 never changes, its checkpoint is never used
+	for (int32_t layerIndex = 1; layerIndex < state.LayerCount() - 1; ++layerIndex)
+	{
+		checkpoints.push_back(MakeCheckpoint());
+		workspace.Layer(state, layerIndex, energy);
+	}
+	checkpoints.push_back(MakeCheckpoint());
+	return TrackedEnergy();
+}
+
+Energy EnergyTracker::Reset(const EnergyTracker &other)
+{
+	assert(other.workspace.tracking);
+	assert(other.proposedFrom == -1);
+	// the checkpoints and the journal are all there is to it, copying them reuses the storage already there
+	workspace = other.workspace;
+	energy = other.energy;
+	proposedFrom = -1;
+	return TrackedEnergy();
+}
+
+Energy EnergyTracker::Propose(const State &neighbour, int32_t firstLayerIndex)
+{
+	auto &checkpoints = workspace.checkpoints;
+	assert(workspace.tracking);
+	assert(proposedFrom == -1);
+	assert(firstLayerIndex >= 1 && firstLayerIndex < int32_t(checkpoints.size()));
+	assert(firstLayerIndex < neighbour.LayerCount());
+	proposedFrom = firstLayerIndex;
+	auto checkpoint = checkpoints[firstLayerIndex];
+	CopyFrom(firstLayerIndex, workspace.savedCheckpoints, workspace.savedJournal);
+	Rewind(checkpoint);
+	checkpoints.resize(firstLayerIndex);
+	for (int32_t layerIndex = firstLayerIndex; layerIndex < neighbour.LayerCount() - 1; ++layerIndex)
+	{
+		checkpoints.push_back(MakeCheckpoint());
+		workspace.Layer(neighbour, layerIndex, energy);
+	}
+	checkpoints.push_back(MakeCheckpoint());
+	auto neighbourEnergy = TrackedEnergy();
+#ifdef SPAGHETTI_CHECK_INCREMENTAL_ENERGY
+	auto fullEnergy = neighbour.GetEnergy<Energy>();
+	if (fullEnergy.partCount != neighbourEnergy.partCount || fullEnergy.storageSlotCount != neighbourEnergy.storageSlotCount)
+	{
+		throw IncrementalEnergyMismatch("incremental energy differs from full energy");
+	}
+#endif
+	return neighbourEnergy;
+}
+
+Energy EnergyTracker::Propose(const KeptProposal &kept)
+{
+	assert(workspace.tracking);
+	assert(proposedFrom == -1);
+	assert(kept.firstLayerIndex >= 1 && kept.firstLayerIndex < int32_t(workspace.checkpoints.size()));
+	proposedFrom = kept.firstLayerIndex;
+	CopyFrom(kept.firstLayerIndex, workspace.savedCheckpoints, workspace.savedJournal);
+	Restore(kept.firstLayerIndex, kept.checkpoints, kept.journal);
+	return TrackedEnergy();
+}
+
+void EnergyTracker::Keep(KeptProposal &kept, int32_t firstLayerIndex) const
+{
+	assert(workspace.tracking);
+	assert(proposedFrom == -1 || proposedFrom == firstLayerIndex);
+	assert(firstLayerIndex >= 1 && firstLayerIndex < int32_t(workspace.checkpoints.size()));
+	kept.firstLayerIndex = firstLayerIndex;
+	CopyFrom(firstLayerIndex, kept.checkpoints, kept.journal);
+}
+
+void EnergyTracker::Accept()
+{
+	assert(proposedFrom != -1);
+	proposedFrom = -1;
+}
+
+int32_t EnergyTracker::PeakLayer() const
+{
+	auto &checkpoints = workspace.checkpoints;
+	if (workspace.slotCount <= workspace.design->storageSlots)
+	{
+		return -1;
+	}
+	// the checkpoint after a layer is the one before the next layer, or the final one
+	int32_t peakLayerIndex = -1;
+	int32_t peakLiveSlotCount = -1;
+	for (int32_t layerIndex = 1; layerIndex + 1 < int32_t(checkpoints.size()); ++layerIndex)
+	{
+		if (peakLiveSlotCount < checkpoints[layerIndex + 1].liveSlotCount)
+		{
+			peakLiveSlotCount = checkpoints[layerIndex + 1].liveSlotCount;
+			peakLayerIndex = layerIndex;
+		}
+	}
+	return peakLayerIndex;
+}
+
+void EnergyTracker::Reject()
+{
+	assert(proposedFrom != -1);
+	Restore(proposedFrom, workspace.savedCheckpoints, workspace.savedJournal);
+	proposedFrom = -1;
+}
+
+template<class EnergyType>
+EnergyType State::GetEnergy(EnergyWorkspace &workspace) const
+{
+	EnergyType energy;
+	workspace.tracking = false;
+	workspace.BeginLayers(*this, energy);
+	for (int32_t layerIndex = 1; layerIndex < LayerCount() - 1; ++layerIndex)
+	{
+		workspace.Layer(*this, layerIndex, energy);
+	}
+	workspace.EndLayers(*this, energy);
+	return energy;
+}
+
+template<class EnergyType>
+EnergyType State::GetEnergy() const
+{
+	EnergyWorkspace workspace;
+	return GetEnergy<EnergyType>(workspace);
+}
+
+template Energy State::GetEnergy<Energy>(EnergyWorkspace &workspace) const;
+template EnergyWithPlan State::GetEnergy<EnergyWithPlan>(EnergyWorkspace &workspace) const;
+template Energy State::GetEnergy<Energy>() const;
+template EnergyWithPlan State::GetEnergy<EnergyWithPlan>() const;
+
+template<class EnergyType>
+std::shared_ptr<const EnergyType> State::GetCachedEnergy(EnergyWorkspace &workspace) const
+{
+	if constexpr (std::is_same_v<EnergyType, EnergyWithPlan>)
+	{
+		auto cached = std::atomic_load(&energyWithPlanCache);
+		if (!cached)
 		{
-			energy.outputRemapFailed = true;
+			cached = std::make_shared<EnergyWithPlan>(GetEnergy<EnergyWithPlan>(workspace));
+			std::atomic_store(&energyWithPlanCache, cached);
 		}
-		else if (outputRemaps.size())
+		return cached;
+	}
+	else
+	{
+		auto cached = std::atomic_load(&energyCache);
+		if (!cached)
 		{
-			auto layerIndex = int32_t(layers.size()) - 1;
-			energy.steps.push_back(EnergyWithPlan::Mode{ { layerIndex }, 0, 0 });
-			for (int32_t outputRemapIndex = 0; outputRemapIndex < int32_t(outputRemaps.size()); ++outputRemapIndex)
+			// the plan version carries everything the plain one does
+			cached = std::atomic_load(&energyWithPlanCache);
+			if (!cached)
 			{
-				auto &outputRemap = outputRemaps[outputRemapIndex];
-				energy.steps.push_back(EnergyWithPlan::Load{ { layerIndex }, -1, 0, outputRemapIndex, outputRemap.from });
-				energy.steps.push_back(EnergyWithPlan::Store{ { layerIndex }, outputRemapIndex, outputRemap.to });
+				cached = std::make_shared<Energy>(GetEnergy<Energy>(workspace));
 			}
-			energy.steps.push_back(EnergyWithPlan::Commit{ layerIndex });
+			std::atomic_store(&energyCache, cached);
 		}
-		energy.SortSteps();
+		return cached;
 	}
-	return energy;
 }
 
-template Energy State::GetEnergy<Energy>() const;
-template EnergyWithPlan State::GetEnergy<EnergyWithPlan>() const;
+template<class EnergyType>
+std::shared_ptr<const EnergyType> State::GetCachedEnergy() const
+{
+	EnergyWorkspace workspace;
+	return GetCachedEnergy<EnergyType>(workspace);
+}
+
+template std::shared_ptr<const Energy> State::GetCachedEnergy<Energy>() const;
+template std::shared_ptr<const EnergyWithPlan> State::GetCachedEnergy<EnergyWithPlan>() const;
+template std::shared_ptr<const Energy> State::GetCachedEnergy<Energy>(EnergyWorkspace &workspace) const;
+template std::shared_ptr<const EnergyWithPlan> State::GetCachedEnergy<EnergyWithPlan>(EnergyWorkspace &workspace) const;
+
+void State::SetCachedEnergy(Energy energy) const
+{
+	std::atomic_store(&energyCache, std::shared_ptr<const Energy>(std::make_shared<Energy>(energy)));
+}
+
+State::State(const State &other) :
+	iteration(other.iteration),
+	design(other.design),
+	layerBlocks(other.layerBlocks),
+	nodeLayerIndices(other.nodeLayerIndices),
+	operandsSwapped(other.operandsSwapped),
+	energyCache(std::atomic_load(&other.energyCache)),
+	energyWithPlanCache(std::atomic_load(&other.energyWithPlanCache))
+{
+}
+
+State &State::operator =(const State &other)
+{
+	iteration = other.iteration;
+	design = other.design;
+	layerBlocks = other.layerBlocks;
+	nodeLayerIndices = other.nodeLayerIndices;
+	operandsSwapped = other.operandsSwapped;
+	undoLog.clear();
+	moveIndex.reset();
+	energyCache = std::atomic_load(&other.energyCache);
+	energyWithPlanCache = std::atomic_load(&other.energyWithPlanCache);
+	return *this;
+}
 
 std::shared_ptr<State> Design::Initial() const
 {
 	auto state = std::make_shared<State>();
 	state->design = shared_from_this();
 	state->iteration = 0;
-	for (int32_t nodeIndex = 0; nodeIndex < int32_t(nodes.size()); ++nodeIndex)
-	{
-		state->nodeIndices.push_back(nodeIndex);
-	}
-	state->layers.push_back(0);
+	state->nodeLayerIndices.resize(nodes.size());
+	state->operandsSwapped.assign(nodes.size(), 0);
+	auto addLayer = [this, &state](int32_t nodeIndexBegin, int32_t nodeIndexEnd) {
+		auto layerBlock = std::make_shared<State::LayerBlock>();
+		for (auto nodeIndex = nodeIndexBegin; nodeIndex < nodeIndexEnd; ++nodeIndex)
+		{
+			layerBlock->nodeIndices.push_back(nodeIndex);
+			layerBlock->hash ^= nodeHashKeys[nodeIndex];
+			state->nodeLayerIndices[nodeIndex] = state->LayerCount();
+		}
+		layerBlock->orderHash = LayerOrderHash(layerBlock->nodeIndices);
+		state->layerBlocks.push_back(layerBlock);
+	};
+	addLayer(0, constantCount + inputCount);
 	for (int32_t compositeIndex = 0; compositeIndex < compositeCount; ++compositeIndex)
 	{
-		state->layers.push_back(constantCount + inputCount + compositeIndex);
+		auto nodeIndex = constantCount + inputCount + compositeIndex;
+		addLayer(nodeIndex, nodeIndex + 1);
 	}
-	state->layers.push_back(constantCount + inputCount + compositeCount);
+	addLayer(constantCount + inputCount + compositeCount, int32_t(nodes.size()));
 	return state;
 }
 
@@ -894,7 +2486,8 @@ std::istream &operator >>(std::istream &stream, Design &design)
 std::ostream &operator <<(std::ostream &stream, const State &state)
 {
 	stream << std::setfill('0');
-	auto plan = state.GetEnergy<EnergyWithPlan>();
+	auto cachedPlan = state.GetCachedEnergy<EnergyWithPlan>();
+	auto &plan = *cachedPlan;
 	stream << " >>> successful transitions: " << state.iteration << std::endl;
 	stream << " >>>     storage slot count: " << plan.storageSlotCount;
 	auto showStorageSlots = state.design->storageSlots;
@@ -980,7 +2573,7 @@ std::ostream &operator <<(std::ostream &stream, const State &state)
 		}
 		handleStoragePlanStep(step);
 	}
-	for (int32_t layerIndex = 1; layerIndex < int32_t(state.layers.size()) - 1; ++layerIndex)
+	for (int32_t layerIndex = 1; layerIndex < state.LayerCount() - 1; ++layerIndex)
 	{
 		auto storageSlotsCopy = storageSlots;
 		struct WorkSlotState
@@ -1149,63 +2742,54 @@ std::ostream &operator <<(std::ostream &stream, const Plan &plan)
 
 std::optional<Design::CheckResult> Design::CheckLayer(const std::vector<int32_t> &nodeIndices) const
 {
-	// we assume that node order between layers is correct
-	// but we detect node order violations within the layer
-	for (int32_t nodeIndicesIndex = 0; nodeIndicesIndex < int32_t(nodeIndices.size()) - 1; ++nodeIndicesIndex)
-	{
-		auto &node = nodes[nodeIndices[nodeIndicesIndex]];
-		if (node.type == Node::select)
+	return std::visit([this, &nodeIndices](auto &flat) -> std::optional<CheckResult> {
+		// we assume that node order between layers is correct
+		// but we detect node order violations within the layer
+		for (int32_t nodeIndicesIndex = 0; nodeIndicesIndex < int32_t(nodeIndices.size()) - 1; ++nodeIndicesIndex)
 		{
-			// select somewhere other than at the end
-			return std::nullopt;
+			if (flat.nodeTypes[nodeIndices[nodeIndicesIndex]] == Node::select)
+			{
+				// select somewhere other than at the end
+				return std::nullopt;
+			}
 		}
-	}
-	CheckResult checkResult;
-	checkResult.workSlots = 0;
-	auto nodeIndexInLayer = [&nodeIndices](int32_t nodeIndex) -> std::optional<int32_t> {
-		auto it = std::find(nodeIndices.begin(), nodeIndices.end(), nodeIndex);
-		if (it == nodeIndices.end())
+		CheckResult checkResult;
+		checkResult.workSlots = 0;
+		auto &marks = layerMarks;
+		marks.Reset(int32_t(nodes.size()));
+		for (auto nodeIndex : nodeIndices)
 		{
-			return std::nullopt;
+			marks.nodeStamps[nodeIndex] = marks.stamp;
 		}
-		return int32_t(it - nodeIndices.begin());
-	};
-	for (int32_t nodeIndicesIndex = 0; nodeIndicesIndex < int32_t(nodeIndices.size()); ++nodeIndicesIndex)
-	{
-		auto &node = nodes[nodeIndices[nodeIndicesIndex]];
-		checkResult.workSlots += node.workSlotsNeeded;
-		int32_t sameLayerBinaryLinkCount = 0;
-		for (auto linkIndex : node.linkIndices[linkDownstream])
+		for (int32_t nodeIndicesIndex = 0; nodeIndicesIndex < int32_t(nodeIndices.size()); ++nodeIndicesIndex)
 		{
-			auto &link = links[linkIndex];
-			auto linkedNodeIndex = link.directions[linkDownstream].nodeIndex;
-			auto &linkedNode = nodes[linkedNodeIndex];
-			auto linkedNodeIndexInLayer = nodeIndexInLayer(linkedNodeIndex);
-			if (linkedNodeIndexInLayer)
+			auto nodeIndex = nodeIndices[nodeIndicesIndex];
+			checkResult.workSlots += flat.workSlotsNeeded[nodeIndex];
+			auto nextNodeIndex = nodeIndicesIndex + 1 < int32_t(nodeIndices.size()) ? nodeIndices[nodeIndicesIndex + 1] : -1;
+			int32_t sameLayerBinaryLinkCount = 0;
+			for (int32_t linkEnd = flat.linkBegins[linkDownstream][nodeIndex]; linkEnd < flat.linkBegins[linkDownstream][nodeIndex + 1]; ++linkEnd)
 			{
-				if (link.type == Link::toBinary)
+				auto rule = flat.sameLayerRules[linkDownstream][linkEnd];
+				if (rule == sameLayerIgnore)
+				{
+					continue;
+				}
+				auto linkedNodeIndex = int32_t(flat.linkedNodeIndices[linkDownstream][linkEnd]);
+				if (marks.nodeStamps[linkedNodeIndex] != marks.stamp)
+				{
+					continue;
+				}
+				if (rule == sameLayerForbid)
+				{
+					return std::nullopt;
+				}
+				if (rule == sameLayerChain)
 				{
-					if (*linkedNodeIndexInLayer != nodeIndicesIndex + 1)
+					if (linkedNodeIndex != nextNodeIndex)
 					{
 						// binary same-layer link with non-adjacent node
 						return std::nullopt;
 					}
-					int32_t lhsIndex = 1;
-					if (linkedNode.type == Node::select)
-					{
-						auto laneCount = int32_t(linkedNode.sources.size());
-						lhsIndex += laneCount * 2;
-					}
-					if (link.directions[linkDownstream].linkIndicesIndex == lhsIndex && !tmpCommutativity[linkedNode.tmps[0]])
-					{
-						// binary same-layer link to lhs of non-commutative node
-						return std::nullopt;
-					}
-					if (link.directions[linkDownstream].linkIndicesIndex > lhsIndex)
-					{
-						// binary same-layer link to parameter of higher index than that of rhs or lhs
-						return std::nullopt;
-					}
 					sameLayerBinaryLinkCount += 1;
 					if (sameLayerBinaryLinkCount > 1)
 					{
@@ -1213,25 +2797,17 @@ std::optional<Design::CheckResult> Design::CheckLayer(const std::vector<int32_t>
 						return std::nullopt;
 					}
 				}
-				if (link.type == Link::toSelectNonzero)
-				{
-					// nonzero same-layer link
-					return std::nullopt;
-				}
-				if (link.type == Link::toBinary || link.type == Link::toSelectZero)
-				{
-					// this saves a load
-					checkResult.workSlots -= 1;
-				}
+				// this saves a load
+				checkResult.workSlots -= 1;
 			}
 		}
-	}
-	if (checkResult.workSlots <= workSlots)
-	{
-		return checkResult;
-	}
-	// needs too many work slots
-	return std::nullopt;
+		if (checkResult.workSlots <= workSlots)
+		{
+			return checkResult;
+		}
+		// needs too many work slots
+		return std::nullopt;
+	}, flat);
 }
 
 Design::Design(
@@ -1335,82 +2911,565 @@ Design::Design(
 				link(node, nonzeroSource, Link::toSelectNonzero);
 				link(node, zeroSource, Link::toSelectZero);
 			}
-			for (int32_t stageIndex = 0; stageIndex < stageCount; ++stageIndex)
+			for (int32_t stageIndex = 0; stageIndex < stageCount; ++stageIndex)
+			{
+				if (stageIndex > 0)
+				{
+					auto tmp = protoSelect->tmps[stageIndex - 1];
+					CheckRange(tmp, 0, tmpCount);
+					node.tmps[stageIndex - 1] = tmp;
+				}
+				auto source = protoSelect->sources[laneCount * 2 + stageIndex];
+				CheckRange(source, 0, sources.size());
+				link(node, source, Link::toBinary);
+			}
+			for (int32_t laneIndex = 0; laneIndex < laneCount; ++laneIndex)
+			{
+				presentSource(nodeIndex, laneIndex);
+			}
+		}
+		else if (auto *protoBinary = std::get_if<ProtoBinary>(&protoComposite))
+		{
+			node.type = Node::binary;
+			node.tmps.resize(1);
+			node.tmps[0] = protoBinary->tmp;
+			auto rhsSource = protoBinary->rhsSource;
+			auto lhsSource = protoBinary->lhsSource;
+			CheckRange(node.tmps[0], 0, tmpCount);
+			CheckRange(rhsSource, 0, sources.size());
+			CheckRange(lhsSource, 0, sources.size());
+			link(node, rhsSource, Link::toBinary);
+			link(node, lhsSource, Link::toBinary);
+			if (tmpCommutativity[node.tmps[0]] && rhsSource != lhsSource)
+			{
+				swappableNodeIndices.push_back(nodeIndex);
+			}
+			node.workSlotsNeeded = 2;
+			presentSource(nodeIndex, 0);
+		}
+	}
+	outputLinks.resize(outputCount);
+	for (int32_t outputIndex = 0; outputIndex < outputCount; ++outputIndex)
+	{
+		auto nodeIndex = constantCount + inputCount + compositeCount + outputIndex;
+		auto &node = nodes[nodeIndex];
+		auto &outputSource = outputLinks[outputIndex].sourceIndex;
+		auto &outputStorageSlot = outputLinks[outputIndex].storageSlot;
+		outputSource = newOutputLinks[outputIndex].source;
+		outputStorageSlot = newOutputLinks[outputIndex].storageSlot;
+		CheckRange(outputSource, 0, sources.size());
+		CheckRange(outputStorageSlot, 0, storageSlots);
+		node.type = Node::output;
+		link(node, outputSource, Link::toOutput);
+	}
+	clobberStorageSlots.resize(newClobberStorageSlots.size());
+	for (int32_t clobberIndex = 0; clobberIndex < int32_t(clobberStorageSlots.size()); ++clobberIndex)
+	{
+		clobberStorageSlots[clobberIndex] = newClobberStorageSlots[clobberIndex];
+		CheckRange(clobberStorageSlots[clobberIndex], 0, storageSlots);
+	}
+	disallowConstantsInSlots.assign(WordCount(storageSlots), 0);
+	for (auto &outputLink : outputLinks)
+	{
+		sources[outputLink.sourceIndex].outputStorageSlots.push_back(outputLink.storageSlot);
+		disallowConstantsInSlots[outputLink.storageSlot / wordBits] |= WordBit(outputLink.storageSlot);
+	}
+	for (auto clobberStorageSlot : clobberStorageSlots)
+	{
+		disallowConstantsInSlots[clobberStorageSlot / wordBits] |= WordBit(clobberStorageSlot);
+	}
+	// offsets go up to the number of links, indices only up to the number of nodes and sources
+	if (std::max({ nodes.size(), links.size(), sources.size() }) <= std::numeric_limits<uint16_t>::max())
+	{
+		flat = MakeFlatGraph<uint16_t>(nodes, links);
+	}
+	else
+	{
+		flat = MakeFlatGraph<int32_t>(nodes, links);
+	}
+	std::mt19937_64 hashRng;
+	nodeHashKeys.resize(nodes.size());
+	for (auto &nodeHashKey : nodeHashKeys)
+	{
+		nodeHashKey = hashRng();
+	}
+	serial = nextDesignSerial.fetch_add(1);
+	// nodes are in topological order, see Initial
+	asapLayers.assign(nodes.size(), 0);
+	alapMargins.assign(nodes.size(), 0);
+	std::visit([this](auto &flat) {
+		auto compositesBegin = constantCount + inputCount;
+		auto compositesEnd = compositesBegin + compositeCount;
+		for (auto nodeIndex = compositesBegin; nodeIndex < compositesEnd; ++nodeIndex)
+		{
+			// composites can't share the first layer with constants and inputs
+			asapLayers[nodeIndex] = 1;
+			for (int32_t linkEnd = flat.linkBegins[linkUpstream][nodeIndex]; linkEnd < flat.linkBegins[linkUpstream][nodeIndex + 1]; ++linkEnd)
+			{
+				auto apart = flat.sameLayerRules[linkUpstream][linkEnd] == sameLayerForbid ? 1 : 0;
+				asapLayers[nodeIndex] = std::max(asapLayers[nodeIndex], asapLayers[flat.linkedNodeIndices[linkUpstream][linkEnd]] + apart);
+			}
+		}
+		for (auto nodeIndex = compositesEnd - 1; nodeIndex >= compositesBegin; --nodeIndex)
+		{
+			// or the last layer with outputs
+			alapMargins[nodeIndex] = 1;
+			for (int32_t linkEnd = flat.linkBegins[linkDownstream][nodeIndex]; linkEnd < flat.linkBegins[linkDownstream][nodeIndex + 1]; ++linkEnd)
+			{
+				auto apart = flat.sameLayerRules[linkDownstream][linkEnd] == sameLayerForbid ? 1 : 0;
+				alapMargins[nodeIndex] = std::max(alapMargins[nodeIndex], alapMargins[flat.linkedNodeIndices[linkDownstream][linkEnd]] + apart);
+			}
+		}
+	}, flat);
+}
+
+namespace
+{
+	double TransitionProbability(double energy, double newEnergy, double temperature)
+	{
+		if (newEnergy < energy)
+		{
+			return 1.0;
+		}
+		return std::exp(-(newEnergy - energy) / temperature);
+	}
+
+	// adaptive move kind selection, see OptimizeOnce
+	constexpr double adaptiveMinShare = 0.2; // split evenly between the kinds in use
+	constexpr double adaptiveRewardDecay = 0.05;
+	constexpr double adaptivePursuitRate = 0.01;
+
+	// Metropolis-Hastings, for proposals that aren't symmetric; the ratio is that of the probability
+	// of proposing the reverse move from the new state to that of proposing the move from the old one
+	double TransitionProbability(double energy, double newEnergy, double temperature, double proposalRatio)
+	{
+		return std::min(1.0, std::exp(-(newEnergy - energy) / temperature) * proposalRatio);
+	}
+
+	// modified Lam schedule, see coolingAdaptive
+	constexpr double lamAcceptanceRate = 0.44;
+	constexpr double lamTemperatureStep = 0.999;
+	constexpr double acceptanceRateWindow = 500.0; // iterations, roughly, see CoolingState
+	constexpr int32_t cancelCheckInterval = 256; // iterations, see OptimizeParameters::cancelRequest
+
+	double LamTargetAcceptanceRate(double progress)
+	{
+		if (progress < 0.15)
+		{
+			return lamAcceptanceRate + (1.0 - lamAcceptanceRate) * std::pow(560.0, -progress / 0.15);
+		}
+		if (progress < 0.65)
+		{
+			return lamAcceptanceRate;
+		}
+		return lamAcceptanceRate * std::pow(440.0, -(progress - 0.65) / 0.35);
+	}
+
+	// schedules that don't depend on what happened during the iteration, see RunSpeculatively
+	double CooledTemperature(double temperature, const OptimizeParameters &op)
+	{
+		if (op.cooling == coolingGeometric)
+		{
+			return temperature * (1.0 - op.temperatureLoss);
+		}
+		return temperature - op.temperatureLoss;
+	}
+
+	void CountIteration(CoolingState &coolingState, bool accepted, double energy)
+	{
+		coolingState.iterationCount += 1;
+		coolingState.acceptanceRate += (double(accepted) - coolingState.acceptanceRate) / acceptanceRateWindow;
+		if (coolingState.lowestEnergy > energy)
+		{
+			coolingState.lowestEnergy = energy;
+			coolingState.stagnantIterationCount = 0;
+		}
+		else
+		{
+			coolingState.stagnantIterationCount += 1;
+		}
+	}
+
+	// candidates of the iteration in progress, their energies and what the tracker made of them, see MultiTryMove
+	thread_local std::vector<Move> multiTryMoves;
+	thread_local std::vector<double> multiTryEnergies;
+	thread_local std::vector<EnergyTracker::KeptProposal> multiTryKept;
+	thread_local EnergyTracker::KeptProposal multiTryCurrent;
+
+	// multiple-try Metropolis with op.multiTry candidates drawn with op.proposal, weighted by their Boltzmann factors;
+	// one of them is picked in proportion to its weight, then as many reference states are drawn from it, except one
+	// of them is the current state, and the move is taken with the ratio of the sums of the weights on the two sides;
+	// the current state is the tracker's, the state is left as it was if the move isn't taken
+	bool MultiTryMove(std::mt19937_64 &rng, State &state, EnergyTracker &tracker, Energy &energy, double temperature, const OptimizeParameters &op, int32_t &layersEvaluated)
+	{
+		std::uniform_real_distribution<double> rdist(0.0, 1.0);
+		multiTryMoves.clear();
+		multiTryEnergies.clear();
+		if (int32_t(multiTryKept.size()) < op.multiTry)
+		{
+			multiTryKept.resize(op.multiTry);
+		}
+		auto evaluate = [&state, &tracker, &layersEvaluated](const Move &move, EnergyTracker::KeptProposal *kept) {
+			auto firstLayerIndex = state.FirstLayerAffectedBy(move);
+			state.ApplyMove(move);
+			layersEvaluated += state.LayerCount() - firstLayerIndex;
+			auto newEnergy = tracker.Propose(state, firstLayerIndex).linear;
+			if (kept)
+			{
+				tracker.Keep(*kept, firstLayerIndex);
+			}
+			state.UndoMove();
+			tracker.Reject();
+			return newEnergy;
+		};
+		for (int32_t tryIndex = 0; tryIndex < op.multiTry; ++tryIndex)
+		{
+			auto move = state.RandomMove(rng, op.proposal);
+			if (!move)
+			{
+				// nowhere to go, the only neighbour is the state itself
+				return false;
+			}
+			multiTryMoves.push_back(*move);
+			multiTryEnergies.push_back(evaluate(*move, &multiTryKept[tryIndex]));
+		}
+		// weights are relative to that of the lowest energy seen so that they don't all vanish at low temperatures
+		auto lowestEnergy = std::min(energy.linear, *std::min_element(multiTryEnergies.begin(), multiTryEnergies.end()));
+		auto weight = [temperature, &lowestEnergy](double someEnergy) {
+			return std::exp(-(someEnergy - lowestEnergy) / temperature);
+		};
+		auto forwardSum = 0.0;
+		for (auto candidateEnergy : multiTryEnergies)
+		{
+			forwardSum += weight(candidateEnergy);
+		}
+		auto pick = rdist(rng) * forwardSum;
+		int32_t pickIndex = 0;
+		while (pickIndex + 1 < op.multiTry && pick >= weight(multiTryEnergies[pickIndex]))
+		{
+			pick -= weight(multiTryEnergies[pickIndex]);
+			pickIndex += 1;
+		}
+		auto &picked = multiTryKept[pickIndex];
+		// the references are neighbours of the picked state, so it becomes the tracker's state for a while;
+		// the current state is kept so that it can come back the same way if the move isn't taken
+		tracker.Keep(multiTryCurrent, picked.firstLayerIndex);
+		state.ApplyMove(multiTryMoves[pickIndex]);
+		auto pickedTrackerEnergy = tracker.Propose(picked);
+		tracker.Accept();
+		multiTryEnergies.clear();
+		for (int32_t tryIndex = 1; tryIndex < op.multiTry; ++tryIndex)
+		{
+			if (auto move = state.RandomMove(rng, op.proposal))
+			{
+				multiTryEnergies.push_back(evaluate(*move, nullptr));
+			}
+		}
+		auto backwardSum = weight(energy.linear);
+		for (auto referenceEnergy : multiTryEnergies)
+		{
+			backwardSum += weight(referenceEnergy);
+		}
+		if (forwardSum >= rdist(rng) * backwardSum)
+		{
+			state.ForgetMoves();
+			energy = pickedTrackerEnergy;
+			return true;
+		}
+		state.UndoMoves();
+		tracker.Propose(multiTryCurrent);
+		tracker.Accept();
+		return false;
+	}
+
+	// threads that run the same job alongside the calling thread, see RunSpeculatively
+	class JobGroup
+	{
+		std::vector<std::thread> threads;
+		std::function<void (int32_t)> job;
+		int64_t jobSerial = 0;
+		int32_t busyCount = 0;
+		bool exit = false;
+		std::mutex mx;
+		std::condition_variable cv;
+
+	public:
+		JobGroup(int32_t threadCount)
+		{
+			for (int32_t threadIndex = 1; threadIndex < threadCount; ++threadIndex)
+			{
+				threads.emplace_back([this, threadIndex]() {
+					int64_t lastJobSerial = 0;
+					while (true)
+					{
+						{
+							std::unique_lock lk(mx);
+							cv.wait(lk, [this, &lastJobSerial]() {
+								return exit || jobSerial != lastJobSerial;
+							});
+							if (exit)
+							{
+								break;
+							}
+							lastJobSerial = jobSerial;
+						}
+						job(threadIndex);
+						{
+							std::unique_lock lk(mx);
+							busyCount -= 1;
+						}
+						cv.notify_all();
+					}
+				});
+			}
+		}
+
+		// the calling thread does the job with index 0
+		void Run(std::function<void (int32_t)> newJob)
+		{
+			{
+				std::unique_lock lk(mx);
+				job = newJob;
+				jobSerial += 1;
+				busyCount = int32_t(threads.size());
+			}
+			cv.notify_all();
+			job(0);
+			std::unique_lock lk(mx);
+			cv.wait(lk, [this]() {
+				return !busyCount;
+			});
+		}
+
+		~JobGroup()
+		{
+			{
+				std::unique_lock lk(mx);
+				exit = true;
+			}
+			cv.notify_all();
+			for (auto &thr : threads)
+			{
+				thr.join();
+			}
+		}
+	};
+
+	// the threads and copies of the state RunSpeculatively works with, kept by callers that anneal in rounds
+	// so that they're only set up once; the copies are brought up to date with each round's state
+	struct SpeculationWorkers
+	{
+		struct Copy
+		{
+			State state;
+			EnergyWorkspace workspace;
+			EnergyTracker tracker;
+
+			Copy() : tracker(workspace)
+			{
+			}
+		};
+		int32_t workerCount;
+		JobGroup jobGroup;
+		std::vector<std::unique_ptr<Copy>> copies;
+		// the state the copies were left at, they needn't be brought up to date if the next round starts from it
+		std::shared_ptr<const State> syncedState;
+
+		SpeculationWorkers(int32_t newWorkerCount) : workerCount(newWorkerCount), jobGroup(newWorkerCount)
+		{
+			for (int32_t workerIndex = 1; workerIndex < workerCount; ++workerIndex)
+			{
+				copies.push_back(std::make_unique<Copy>());
+			}
+		}
+	};
+
+	// what's left of OptimizeOnce with op.speculation > 1, see OptimizeParameters; each batch is drawn
+	// in the same order as the sequential loop would draw it, as if every move in it were rejected, then evaluated
+	// in parallel on copies of the state; the first move that passes is taken, every copy catches up with it,
+	// and the generator goes back to where it was right after that move, so the outcome is that of the sequential loop;
+	// stateIn is the state the caller started from, the tracker's state is a copy of it
+	void RunSpeculatively(std::mt19937_64 &rng, SpeculationWorkers &workers, const State &stateIn, const std::shared_ptr<State> &statePtr, EnergyTracker &tracker, Energy &energy, double &temperature, const OptimizeParameters &op, MoveKindStats &stats, CoolingState &coolingState)
+	{
+		struct Candidate
+		{
+			std::optional<Move> move;
+			int32_t firstLayerIndex;
+			double temperature;
+			double threshold; // checked against the transition probability
+			std::mt19937_64 rngAfter;
+			Energy newEnergy;
+			bool accepted;
+		};
+		auto &state = *statePtr;
+		auto workerCount = workers.workerCount;
+		auto &jobGroup = workers.jobGroup;
+		std::vector<State *> workerStates{ &state };
+		std::vector<EnergyTracker *> workerTrackers{ &tracker };
+		for (auto &copy : workers.copies)
+		{
+			workerStates.push_back(&copy->state);
+			workerTrackers.push_back(&copy->tracker);
+		}
+		if (workers.syncedState.get() != &stateIn)
+		{
+			// copies mustn't share layers, they change in different threads, see MutableLayer
+			jobGroup.Run([&workerStates, &workerTrackers, &state, &tracker](int32_t workerIndex) {
+				if (workerIndex)
+				{
+					workerStates[workerIndex]->AssignDetached(state);
+					workerTrackers[workerIndex]->Reset(tracker);
+				}
+			});
+		}
+		std::uniform_real_distribution<double> rdist(0.0, 1.0);
+		std::vector<Candidate> candidates(workerCount);
+		int32_t iterationIndex = 0;
+		auto nextCancelCheck = cancelCheckInterval;
+		while (iterationIndex < op.iterationCount && temperature > op.temperatureFinal)
+		{
+			if (op.cancelRequest && iterationIndex >= nextCancelCheck)
+			{
+				if (*op.cancelRequest)
+				{
+					break;
+				}
+				nextCancelCheck = iterationIndex + cancelCheckInterval;
+			}
+			int32_t candidateCount = 0;
+			auto candidateTemperature = temperature;
+			while (candidateCount < workerCount && iterationIndex + candidateCount < op.iterationCount && candidateTemperature > op.temperatureFinal)
 			{
-				if (stageIndex > 0)
+				auto &candidate = candidates[candidateCount];
+				candidate.move = state.RandomMove(rng, op.proposal);
+				if (candidate.move)
 				{
-					auto tmp = protoSelect->tmps[stageIndex - 1];
-					CheckRange(tmp, 0, tmpCount);
-					node.tmps[stageIndex - 1] = tmp;
+					candidate.firstLayerIndex = state.FirstLayerAffectedBy(*candidate.move);
 				}
-				auto source = protoSelect->sources[laneCount * 2 + stageIndex];
-				CheckRange(source, 0, sources.size());
-				link(node, source, Link::toBinary);
+				candidate.temperature = candidateTemperature;
+				candidate.threshold = rdist(rng);
+				candidate.rngAfter = rng;
+				candidateTemperature = CooledTemperature(candidateTemperature, op);
+				candidateCount += 1;
 			}
-			for (int32_t laneIndex = 0; laneIndex < laneCount; ++laneIndex)
+			jobGroup.Run([&workerStates, &workerTrackers, &candidates, &energy, candidateCount](int32_t workerIndex) {
+				auto &candidate = candidates[workerIndex];
+				candidate.accepted = false;
+				if (workerIndex >= candidateCount || !candidate.move)
+				{
+					return;
+				}
+				auto &workerState = *workerStates[workerIndex];
+				auto &workerTracker = *workerTrackers[workerIndex];
+				workerState.ApplyMove(*candidate.move);
+				candidate.newEnergy = workerTracker.Propose(workerState, candidate.firstLayerIndex);
+				candidate.accepted = TransitionProbability(energy.linear, candidate.newEnergy.linear, candidate.temperature) >= candidate.threshold;
+				if (!candidate.accepted)
+				{
+					workerState.UndoMoves();
+					workerTracker.Reject();
+				}
+			});
+			auto takenIndex = int32_t(std::find_if(candidates.begin(), candidates.begin() + candidateCount, [](auto &candidate) {
+				return candidate.accepted;
+			}) - candidates.begin());
+			// the iterations up to the one taken, or all of them
+			auto countedCount = std::min(takenIndex + 1, candidateCount);
+			for (int32_t candidateIndex = 0; candidateIndex < countedCount; ++candidateIndex)
 			{
-				presentSource(nodeIndex, laneIndex);
+				auto taken = candidateIndex == takenIndex;
+				CountIteration(coolingState, taken, taken ? candidates[candidateIndex].newEnergy.linear : energy.linear);
 			}
+			if (takenIndex == candidateCount)
+			{
+				iterationIndex += candidateCount;
+				temperature = candidateTemperature;
+				stats.proposalCount += candidateCount;
+				continue;
+			}
+			jobGroup.Run([&workerStates, &workerTrackers, &candidates, takenIndex](int32_t workerIndex) {
+				auto &workerState = *workerStates[workerIndex];
+				auto &workerTracker = *workerTrackers[workerIndex];
+				auto &taken = candidates[takenIndex];
+				if (workerIndex != takenIndex)
+				{
+					if (candidates[workerIndex].accepted)
+					{
+						workerState.UndoMoves();
+						workerTracker.Reject();
+					}
+					workerState.ApplyMove(*taken.move);
+					workerTracker.Propose(workerState, taken.firstLayerIndex);
+				}
+				workerState.ForgetMoves();
+				workerTracker.Accept();
+			});
+			auto &taken = candidates[takenIndex];
+			iterationIndex += takenIndex + 1;
+			temperature = CooledTemperature(taken.temperature, op);
+			rng = taken.rngAfter;
+			stats.proposalCount += takenIndex + 1;
+			stats.acceptanceCount += 1;
+			stats.improvementSum += energy.linear - taken.newEnergy.linear;
+			energy = taken.newEnergy;
 		}
-		else if (auto *protoBinary = std::get_if<ProtoBinary>(&protoComposite))
-		{
-			node.type = Node::binary;
-			node.tmps.resize(1);
-			node.tmps[0] = protoBinary->tmp;
-			auto rhsSource = protoBinary->rhsSource;
-			auto lhsSource = protoBinary->lhsSource;
-			CheckRange(node.tmps[0], 0, tmpCount);
-			CheckRange(rhsSource, 0, sources.size());
-			CheckRange(lhsSource, 0, sources.size());
-			link(node, rhsSource, Link::toBinary);
-			link(node, lhsSource, Link::toBinary);
-			node.workSlotsNeeded = 2;
-			presentSource(nodeIndex, 0);
-		}
-	}
-	outputLinks.resize(outputCount);
-	for (int32_t outputIndex = 0; outputIndex < outputCount; ++outputIndex)
-	{
-		auto nodeIndex = constantCount + inputCount + compositeCount + outputIndex;
-		auto &node = nodes[nodeIndex];
-		auto &outputSource = outputLinks[outputIndex].sourceIndex;
-		auto &outputStorageSlot = outputLinks[outputIndex].storageSlot;
-		outputSource = newOutputLinks[outputIndex].source;
-		outputStorageSlot = newOutputLinks[outputIndex].storageSlot;
-		CheckRange(outputSource, 0, sources.size());
-		CheckRange(outputStorageSlot, 0, storageSlots);
-		node.type = Node::output;
-		link(node, outputSource, Link::toOutput);
-	}
-	clobberStorageSlots.resize(newClobberStorageSlots.size());
-	for (int32_t clobberIndex = 0; clobberIndex < int32_t(clobberStorageSlots.size()); ++clobberIndex)
-	{
-		clobberStorageSlots[clobberIndex] = newClobberStorageSlots[clobberIndex];
-		CheckRange(clobberStorageSlots[clobberIndex], 0, storageSlots);
+		workers.syncedState = statePtr;
 	}
 }
 
+// OptimizeOnce with the speculation workers of the caller, created or replaced as needed
+OptimizerState OptimizeOnce(std::mt19937_64 &rng, EnergyWorkspace &workspace, std::unique_ptr<SpeculationWorkers> &speculationWorkers, const State &stateIn, OptimizeParameters op);
+
 namespace
 {
-	double TransitionProbability(double energy, double newEnergy, double temperature)
-	{
-		if (newEnergy < energy)
-		{
-			return 1.0;
-		}
-		return std::exp(-(newEnergy - energy) / temperature);
-	}
-
 	struct ThreadContext
 	{
 		std::mt19937_64 rng;
+		EnergyWorkspace workspace;
 		std::thread thr;
 		OptimizerState ostate;
+		double temperatureScale = 1.0; // the thread's rung on the temperature ladder, see DispatchParameters
+		MoveKindWeights moveKindWeights = {}; // adaptive ones of this thread, carried across rounds; all zero before the first
+		const std::atomic<bool> *cancelRequest = nullptr; // see OptimizeParameters
+		std::unique_ptr<SpeculationWorkers> speculationWorkers; // kept across rounds
 		bool threadWorking = false;
 		bool threadExit = false;
 		std::mutex threadStateMx;
 		std::condition_variable threadStateCv;
 
+		OptimizeParameters MakeParameters(const Optimizer::DispatchParameters &dp) const
+		{
+			OptimizeParameters op;
+			op.temperatureInitial = ostate.temperature;
+			op.iterationCount     = dp.iterationCount;
+			op.temperatureFinal   = dp.temperatureFinal * temperatureScale;
+			// only linear cooling has a loss in units of temperature
+			op.temperatureLoss    = dp.temperatureLoss * (dp.cooling == coolingLinear ? temperatureScale : 1.0);
+			op.proposal           = dp.proposal;
+			op.moveKindWeights    = dp.moveKindWeights;
+			op.adaptiveMoveKinds  = dp.adaptiveMoveKinds;
+			op.speculation        = dp.speculation;
+			op.multiTry           = dp.multiTry;
+			op.cooling            = dp.cooling;
+			op.reheatAfter        = dp.reheatAfter;
+			op.reheatFactor       = dp.reheatFactor;
+			op.reheatLimit        = dp.reheatLimit;
+			op.coolingState       = ostate.coolingState;
+			op.cancelRequest      = cancelRequest;
+			if (dp.adaptiveMoveKinds && std::accumulate(moveKindWeights.begin(), moveKindWeights.end(), 0.0) > 0)
+			{
+				// carry on from where the last round left off
+				op.moveKindWeights = moveKindWeights;
+			}
+			return op;
+		}
+
+		void Optimize(const Optimizer::DispatchParameters &dp)
+		{
+			ostate = OptimizeOnce(rng, workspace, speculationWorkers, *ostate.state, MakeParameters(dp));
+			moveKindWeights = ostate.moveKindWeights;
+		}
+
 		void ThreadFunc(Optimizer::DispatchParameters dp)
 		{
 			while (true)
@@ -1425,12 +3484,7 @@ namespace
 						break;
 					}
 				}
-				OptimizeParameters op;
-				op.temperatureInitial = ostate.temperature;
-				op.iterationCount     = dp.iterationCount;
-				op.temperatureFinal   = dp.temperatureFinal;
-				op.temperatureLoss    = dp.temperatureLoss;
-				ostate = OptimizeOnce(rng, *ostate.state, op);
+				Optimize(dp);
 				{
 					std::unique_lock lk(threadStateMx);
 					threadWorking = false;
@@ -1468,22 +3522,334 @@ namespace
 }
 
 OptimizerState OptimizeOnce(std::mt19937_64 &rng, const State &stateIn, OptimizeParameters op)
+{
+	EnergyWorkspace workspace;
+	return OptimizeOnce(rng, workspace, stateIn, op);
+}
+
+OptimizerState OptimizeOnce(std::mt19937_64 &rng, EnergyWorkspace &workspace, const State &stateIn, OptimizeParameters op)
+{
+	std::unique_ptr<SpeculationWorkers> speculationWorkers;
+	return OptimizeOnce(rng, workspace, speculationWorkers, stateIn, op);
+}
+
+OptimizerState OptimizeOnce(std::mt19937_64 &rng, EnergyWorkspace &workspace, std::unique_ptr<SpeculationWorkers> &speculationWorkers, const State &stateIn, OptimizeParameters op)
 {
 	auto state = std::make_shared<State>(stateIn);
 	std::uniform_real_distribution<double> rdist(0.0, 1.0);
 	auto temperature = op.temperatureInitial;
+	// copies don't take the move index along, so this one belongs to the state as it is now
+	if (op.proposal == proposalIndex)
+	{
+		state->BuildMoveIndex();
+	}
+	EnergyTracker tracker(workspace);
+	auto energy = tracker.Reset(*state);
+	// see State::GuidedMove, kept up to date across accepted moves
+	int32_t peakLayerIndex = -1;
+	PressureNodeSet pressureNodes;
+	PressureNodeSet newPressureNodes;
+	std::vector<Move> guidedNodeMoves;
+	auto updatePressure = [&state, &tracker, &peakLayerIndex, &pressureNodes]() {
+		peakLayerIndex = tracker.PeakLayer();
+		state->PressureNodes(peakLayerIndex, pressureNodes);
+	};
+	if (op.proposal == proposalGuided)
+	{
+		updatePressure();
+	}
+	// most moves get rejected, so change the state in place and change it back if needed
+	auto proposeInPlace = [&state, &tracker, &energy, &temperature, &rdist, &rng](int32_t firstLayerIndex) {
+		auto newEnergy = tracker.Propose(*state, firstLayerIndex);
+		if (TransitionProbability(energy.linear, newEnergy.linear, temperature) >= rdist(rng))
+		{
+			state->ForgetMoves();
+			energy = newEnergy;
+			tracker.Accept();
+			return true;
+		}
+		state->UndoMoves();
+		tracker.Reject();
+		return false;
+	};
+	MoveKindStatsArray moveKindStats;
+	// adaptive pursuit: selection probabilities move towards the kind with the best recent rate of energy lost
+	// per layer evaluated, each kind in use keeps a minimum share so that it can catch up if it becomes useful
+	auto moveKindWeights = op.moveKindWeights;
+	std::array<double, moveKindMax> rewardRates = {};
+	auto activeMoveKindCount = std::count_if(op.moveKindWeights.begin(), op.moveKindWeights.end(), [](auto weight) {
+		return weight > 0;
+	});
+	auto minWeight = adaptiveMinShare / double(activeMoveKindCount);
+	auto maxWeight = 1.0 - double(activeMoveKindCount - 1) * minWeight;
+	if (op.adaptiveMoveKinds)
+	{
+		auto weightSum = std::accumulate(moveKindWeights.begin(), moveKindWeights.end(), 0.0);
+		for (auto &weight : moveKindWeights)
+		{
+			weight /= weightSum;
+		}
+	}
+	auto coolingState = op.coolingState;
+	// see Cooling
+	auto cool = [&op, &coolingState, &temperature, &energy](bool accepted) {
+		CountIteration(coolingState, accepted, energy.linear);
+		if (op.cooling == coolingAdaptive)
+		{
+			auto progress = double(coolingState.iterationCount) * op.temperatureLoss;
+			if (progress >= 1.0)
+			{
+				temperature = std::min(temperature, op.temperatureFinal);
+			}
+			else if (coolingState.acceptanceRate > LamTargetAcceptanceRate(progress))
+			{
+				temperature *= lamTemperatureStep;
+			}
+			else
+			{
+				temperature /= lamTemperatureStep;
+			}
+		}
+		else
+		{
+			temperature = CooledTemperature(temperature, op);
+		}
+		if (op.reheatAfter && coolingState.stagnantIterationCount >= op.reheatAfter && coolingState.reheatCount < op.reheatLimit)
+		{
+			temperature *= op.reheatFactor;
+			coolingState.stagnantIterationCount = 0;
+			coolingState.reheatCount += 1;
+		}
+	};
+	// see OptimizeParameters::speculation
+	if (op.speculation > 1 && op.multiTry == 1 && (op.proposal == proposalRejection || op.proposal == proposalEnumerate) && activeMoveKindCount == 1 && op.moveKindWeights[moveSingle] > 0 && op.cooling != coolingAdaptive && !op.reheatAfter)
+	{
+		if (!speculationWorkers || speculationWorkers->workerCount != op.speculation)
+		{
+			speculationWorkers = std::make_unique<SpeculationWorkers>(op.speculation);
+		}
+		RunSpeculatively(rng, *speculationWorkers, stateIn, state, tracker, energy, temperature, op, moveKindStats[moveSingle], coolingState);
+		state->SetCachedEnergy(energy);
+		return { state, temperature, moveKindWeights, moveKindStats, coolingState };
+	}
 	for (int32_t iterationIndex = 0; iterationIndex < op.iterationCount && temperature > op.temperatureFinal; ++iterationIndex)
 	{
-		auto newState = state->RandomNeighbour(rng);
-		auto energyLinear = state->GetEnergy<Energy>().linear;
-		auto newEnergyLinear = newState->GetEnergy<Energy>().linear;
-		if (TransitionProbability(energyLinear, newEnergyLinear, temperature) >= rdist(rng))
+		if (op.cancelRequest && iterationIndex && !(iterationIndex % cancelCheckInterval) && *op.cancelRequest)
+		{
+			break;
+		}
+		auto moveKind = op.proposal == proposalIndex ? moveSingle : RandomMoveKind(rng, moveKindWeights);
+		auto oldEnergy = energy.linear;
+		auto accepted = false;
+		int32_t layersEvaluated = 0;
+		if (moveKind != moveSingle)
+		{
+			// an invalid compound move counts as a rejected one
+			if (auto firstLayerIndex = state->ApplyCompoundMove(rng, moveKind))
+			{
+				layersEvaluated = state->LayerCount() - *firstLayerIndex;
+				accepted = proposeInPlace(*firstLayerIndex);
+				if (accepted && op.proposal == proposalGuided)
+				{
+					updatePressure();
+				}
+			}
+		}
+		else if (op.proposal == proposalGuided)
+		{
+			if (auto move = state->GuidedMove(rng, peakLayerIndex, pressureNodes.nodeIndices, guidedNodeMoves))
+			{
+				auto direction = state->MoveDirection(*move);
+				auto probability = state->GuidedMoveProbability(move->nodeIndex, direction, peakLayerIndex, int32_t(pressureNodes.nodeIndices.size()), guidedNodeMoves);
+				auto firstLayerIndex = state->FirstLayerAffectedBy(*move);
+				state->ApplyMove(*move);
+				layersEvaluated = state->LayerCount() - firstLayerIndex;
+				auto newEnergy = tracker.Propose(*state, firstLayerIndex);
+				auto newPeakLayerIndex = tracker.PeakLayer();
+				auto rebuildPressure = newPeakLayerIndex != peakLayerIndex || !state->UpdatePressureNodes(move->nodeIndex, newPeakLayerIndex, pressureNodes);
+				if (rebuildPressure)
+				{
+					state->PressureNodes(newPeakLayerIndex, newPressureNodes);
+				}
+				auto newPressureNodeCount = int32_t((rebuildPressure ? newPressureNodes : pressureNodes).nodeIndices.size());
+				// the reverse move takes the node back in the other direction
+				auto reverseProbability = state->GuidedMoveProbability(move->nodeIndex, -direction, newPeakLayerIndex, newPressureNodeCount);
+				if (TransitionProbability(energy.linear, newEnergy.linear, temperature, reverseProbability / probability) >= rdist(rng))
+				{
+					state->ForgetMoves();
+					energy = newEnergy;
+					tracker.Accept();
+					peakLayerIndex = newPeakLayerIndex;
+					if (rebuildPressure)
+					{
+						std::swap(pressureNodes, newPressureNodes);
+					}
+					pressureNodes.Commit();
+					accepted = true;
+				}
+				else
+				{
+					state->UndoMoves();
+					tracker.Reject();
+					pressureNodes.Undo();
+				}
+			}
+		}
+		else if (op.multiTry > 1 && op.proposal != proposalIndex)
+		{
+			accepted = MultiTryMove(rng, *state, tracker, energy, temperature, op, layersEvaluated);
+		}
+		else if (auto move = state->RandomMove(rng, op.proposal))
+		{
+			auto firstLayerIndex = state->FirstLayerAffectedBy(*move);
+			if (op.proposal == proposalIndex)
+			{
+				// updating the move index needs the state before the move too, so neighbours are separate states here
+				auto newState = state->Neighbour(*move);
+				layersEvaluated = newState->LayerCount() - firstLayerIndex;
+				auto newEnergy = tracker.Propose(*newState, firstLayerIndex);
+				if (TransitionProbability(energy.linear, newEnergy.linear, temperature) >= rdist(rng))
+				{
+					newState->TakeMoveIndex(*state, *move);
+					state = newState;
+					energy = newEnergy;
+					tracker.Accept();
+					accepted = true;
+				}
+				else
+				{
+					tracker.Reject();
+				}
+			}
+			else
+			{
+				state->ApplyMove(*move);
+				layersEvaluated = state->LayerCount() - firstLayerIndex;
+				accepted = proposeInPlace(firstLayerIndex);
+			}
+		}
+		else
+		{
+			// nowhere to go, the only neighbour is the state itself
+			rdist(rng);
+		}
+		cool(accepted);
+		auto &stats = moveKindStats[moveKind];
+		stats.proposalCount += 1;
+		if (accepted)
+		{
+			stats.acceptanceCount += 1;
+			stats.improvementSum += oldEnergy - energy.linear;
+		}
+		if (op.adaptiveMoveKinds)
+		{
+			auto reward = std::max(0.0, oldEnergy - energy.linear) / double(1 + layersEvaluated);
+			rewardRates[moveKind] += adaptiveRewardDecay * (reward - rewardRates[moveKind]);
+			auto bestMoveKind = moveSingle;
+			for (auto otherMoveKind = moveSingle; otherMoveKind < moveKindMax; otherMoveKind = MoveKind(int32_t(otherMoveKind) + 1))
+			{
+				if (op.moveKindWeights[otherMoveKind] > 0 && (!(op.moveKindWeights[bestMoveKind] > 0) || rewardRates[otherMoveKind] > rewardRates[bestMoveKind]))
+				{
+					bestMoveKind = otherMoveKind;
+				}
+			}
+			if (rewardRates[bestMoveKind] > 0)
+			{
+				for (auto otherMoveKind = moveSingle; otherMoveKind < moveKindMax; otherMoveKind = MoveKind(int32_t(otherMoveKind) + 1))
+				{
+					if (op.moveKindWeights[otherMoveKind] > 0)
+					{
+						auto target = otherMoveKind == bestMoveKind ? maxWeight : minWeight;
+						moveKindWeights[otherMoveKind] += adaptivePursuitRate * (target - moveKindWeights[otherMoveKind]);
+					}
+				}
+			}
+		}
+	}
+	// the state gets published and maybe changed in place by whoever picks it up next
+	state->DropMoveIndex();
+	state->SetCachedEnergy(energy);
+	return { state, temperature, moveKindWeights, moveKindStats, coolingState };
+}
+
+Calibration Calibrate(std::mt19937_64 &rng, const State &stateIn, CalibrationParameters cp)
+{
+	assert(cp.iterationCount > 0);
+	assert(0 < cp.acceptanceFinal && cp.acceptanceFinal < cp.acceptanceInitial && cp.acceptanceInitial < 1);
+	auto state = std::make_shared<State>(stateIn);
+	EnergyWorkspace workspace;
+	EnergyTracker tracker(workspace);
+	auto energy = tracker.Reset(*state);
+	std::vector<double> deltas;
+	for (int32_t sampleIndex = 0; sampleIndex < cp.sampleCount; ++sampleIndex)
+	{
+		auto move = state->RandomMove(rng);
+		if (!move)
+		{
+			break;
+		}
+		auto firstLayerIndex = state->FirstLayerAffectedBy(*move);
+		state->ApplyMove(*move);
+		auto newEnergy = tracker.Propose(*state, firstLayerIndex);
+		auto delta = newEnergy.linear - energy.linear;
+		// a walk at infinite temperature, the initial state alone is usually much worse than what annealing goes through
+		state->ForgetMoves();
+		tracker.Accept();
+		energy = newEnergy;
+		if (delta > 0)
+		{
+			deltas.push_back(delta);
+		}
+	}
+	auto uphillCount = int32_t(deltas.size());
+	if (deltas.empty())
+	{
+		deltas.push_back(1.0);
+	}
+	auto [ minDelta, maxDelta ] = std::minmax_element(deltas.begin(), deltas.end());
+	Calibration calibration;
+	{
+		// the mean probability grows with the temperature; every delta is accepted with at most the target probability
+		// at the low end and with at least that at the high end, so the temperature wanted is in between
+		auto low = std::log(*minDelta / -std::log(cp.acceptanceInitial));
+		auto high = std::log(*maxDelta / -std::log(cp.acceptanceInitial));
+		for (int32_t step = 0; step < 64; ++step)
 		{
-			state = newState;
+			auto middle = (low + high) / 2.0;
+			auto probabilitySum = 0.0;
+			for (auto delta : deltas)
+			{
+				probabilitySum += std::exp(-delta / std::exp(middle));
+			}
+			if (probabilitySum / double(deltas.size()) < cp.acceptanceInitial)
+			{
+				low = middle;
+			}
+			else
+			{
+				high = middle;
+			}
 		}
-		temperature -= op.temperatureLoss;
+		calibration.temperatureInitial = std::exp((low + high) / 2.0);
+	}
+	// by the end, the moves that still matter are the ones that cost the least
+	calibration.temperatureFinal = *minDelta / -std::log(cp.acceptanceFinal);
+	calibration.uphillCount = uphillCount;
+	switch (cp.cooling)
+	{
+	case coolingLinear:
+		calibration.temperatureLoss = (calibration.temperatureInitial - calibration.temperatureFinal) / double(cp.iterationCount);
+		break;
+
+	case coolingGeometric:
+		calibration.temperatureLoss = 1.0 - std::pow(calibration.temperatureFinal / calibration.temperatureInitial, 1.0 / double(cp.iterationCount));
+		break;
+
+	case coolingAdaptive:
+		calibration.temperatureLoss = 1.0 / double(cp.iterationCount);
+		break;
 	}
-	return { state, temperature };
+	return calibration;
 }
 
 void Optimizer::Dispatch(DispatchParameters dp)
@@ -1492,43 +3858,130 @@ void Optimizer::Dispatch(DispatchParameters dp)
 	ready = false;
 	cancelRequest = false;
 	dispatched = true;
+	assert(dp.temperatureLadder.empty() || dp.temperatureLadder.size() == threadCount);
+	assert(dp.temperatureLadder.empty() || !dp.migrationRate);
+	assert(dp.portfolio.empty() || dp.portfolio.size() == threadCount);
+	assert(dp.cooling != coolingGeometric || dp.temperatureFinal > 0);
 	thr = std::thread([this, dp]() {
+		if (dp.migrationRate)
+		{
+			RunIslands(dp);
+			ready = true;
+			return;
+		}
 		std::vector<ThreadContext> threadContexts(threadCount);
-		for (auto &threadContext : threadContexts)
+		EnergyWorkspace workspace;
+		std::uniform_real_distribution<double> rdist(0.0, 1.0);
+		auto replicaExchange = !dp.temperatureLadder.empty();
+		auto threadDp = [&dp](int32_t threadIndex) -> const DispatchParameters & {
+			return dp.portfolio.empty() ? dp : dp.portfolio[threadIndex];
+		};
+		for (int32_t threadIndex = 0; threadIndex < int32_t(threadContexts.size()); ++threadIndex)
 		{
+			auto &threadContext = threadContexts[threadIndex];
 			threadContext.rng.seed(rng());
-			threadContext.thr = std::thread([&threadContext, dp]() {
-				threadContext.ThreadFunc(dp);
+			// rounds cut short by Cancel are still published as usual
+			threadContext.cancelRequest = &cancelRequest;
+			if (replicaExchange)
+			{
+				// chains start from the same state, each at its own temperature, and carry on from where they left off
+				auto stateSample = PeekState();
+				threadContext.temperatureScale = dp.temperatureLadder[threadIndex];
+				threadContext.ostate = stateSample;
+				threadContext.ostate.temperature *= threadContext.temperatureScale;
+			}
+			threadContext.thr = std::thread([&threadContext, entryDp = threadDp(threadIndex)]() {
+				threadContext.ThreadFunc(entryDp);
 			});
 		}
 		while (true)
 		{
 			auto stateSample = PeekState();
-			if (!(stateSample.temperature > dp.temperatureFinal))
+			// portfolio entries may each have their own final temperature, the dispatch ends when all threads reach theirs
+			auto runningThreadIndex = -1;
+			for (int32_t threadIndex = int32_t(threadContexts.size()) - 1; threadIndex >= 0; --threadIndex)
+			{
+				auto &threadContext = threadContexts[threadIndex];
+				auto temperature = replicaExchange ? threadContext.ostate.temperature : stateSample.temperature;
+				if (temperature > threadDp(threadIndex).temperatureFinal * threadContext.temperatureScale)
+				{
+					runningThreadIndex = threadIndex;
+				}
+			}
+			if (runningThreadIndex == -1)
 			{
 				break;
 			}
 			for (auto &threadContext : threadContexts)
 			{
-				threadContext.ostate = stateSample;
+				if (!replicaExchange)
+				{
+					threadContext.ostate = stateSample;
+				}
 				threadContext.Start();
 			}
 			for (auto &threadContext : threadContexts)
 			{
 				threadContext.Wait();
 			}
-			if (threadContexts.size())
+			if (replicaExchange)
+			{
+				// neighbouring chains swap states with the usual probability, the coldest one gets published
+				for (int32_t threadIndex = 0; threadIndex + 1 < int32_t(threadContexts.size()); ++threadIndex)
+				{
+					auto &colder = threadContexts[threadIndex].ostate;
+					auto &hotter = threadContexts[threadIndex + 1].ostate;
+					auto colderLinear = colder.state->GetCachedEnergy<Energy>(workspace)->linear;
+					auto hotterLinear = hotter.state->GetCachedEnergy<Energy>(workspace)->linear;
+					auto exponent = (1.0 / colder.temperature - 1.0 / hotter.temperature) * (colderLinear - hotterLinear);
+					if (exponent >= 0.0 || std::exp(exponent) >= rdist(rng))
+					{
+						std::swap(colder.state, hotter.state);
+					}
+				}
+				stateSample.state = threadContexts[0].ostate.state;
+				stateSample.temperature = threadContexts[0].ostate.temperature / threadContexts[0].temperatureScale;
+				stateSample.coolingState = threadContexts[0].ostate.coolingState;
+				stateSample.portfolioIndex = 0;
+			}
+			else
 			{
-				stateSample.temperature = threadContexts[0].ostate.temperature;
+				// if nothing improves, the schedule goes on from the first thread that isn't done yet, else it wouldn't
+				{
+					auto &threadContext = threadContexts[runningThreadIndex];
+					stateSample.temperature = threadContext.ostate.temperature;
+					stateSample.coolingState = threadContext.ostate.coolingState;
+				}
+				auto stateLinear = stateSample.state->GetCachedEnergy<Energy>(workspace)->linear;
+				for (int32_t threadIndex = 0; threadIndex < int32_t(threadContexts.size()); ++threadIndex)
+				{
+					auto &threadContext = threadContexts[threadIndex];
+					auto threadStateLinear = threadContext.ostate.state->GetCachedEnergy<Energy>(workspace)->linear;
+					if (stateLinear > threadStateLinear)
+					{
+						// the schedule of the winning thread goes on from here
+						stateSample.state = threadContext.ostate.state;
+						stateSample.temperature = threadContext.ostate.temperature;
+						stateSample.coolingState = threadContext.ostate.coolingState;
+						stateSample.portfolioIndex = threadIndex;
+						stateLinear = threadStateLinear;
+					}
+				}
 			}
-			auto stateLinear = stateSample.state->GetEnergy<Energy>().linear;
+			// statistics of all threads add up; weights are averaged for reporting only, as portfolio entries
+			// may use different move kinds, each thread carries on from its own
+			stateSample.moveKindWeights = {};
+			stateSample.moveKindStats = {};
 			for (auto &threadContext : threadContexts)
 			{
-				auto threadStateLinear = threadContext.ostate.state->GetEnergy<Energy>().linear;
-				if (stateLinear > threadStateLinear)
+				for (int32_t moveKind = 0; moveKind < moveKindMax; ++moveKind)
 				{
-					stateSample.state = threadContext.ostate.state;
-					stateLinear = threadStateLinear;
+					auto &stats = stateSample.moveKindStats[moveKind];
+					auto &threadStats = threadContext.ostate.moveKindStats[moveKind];
+					stateSample.moveKindWeights[moveKind] += threadContext.ostate.moveKindWeights[moveKind] / double(threadContexts.size());
+					stats.proposalCount += threadStats.proposalCount;
+					stats.acceptanceCount += threadStats.acceptanceCount;
+					stats.improvementSum += threadStats.improvementSum;
 				}
 			}
 			PokeState(stateSample);
@@ -1546,6 +3999,99 @@ void Optimizer::Dispatch(DispatchParameters dp)
 	});
 }
 
+void Optimizer::RunIslands(const DispatchParameters &dp)
+{
+	std::vector<ThreadContext> threadContexts(threadCount);
+	// the best state so far and what the islands have to say about their progress, all guarded by islandsMx
+	std::mutex islandsMx;
+	auto best = PeekState();
+	auto bestLinear = best.state->GetCachedEnergy<Energy>()->linear;
+	std::vector<double> temperatures(threadCount, best.temperature);
+	std::vector<MoveKindWeights> moveKindWeights(threadCount);
+	best.moveKindStats = {};
+	for (auto &threadContext : threadContexts)
+	{
+		threadContext.rng.seed(rng());
+		threadContext.ostate = best;
+		threadContext.cancelRequest = &cancelRequest;
+	}
+	for (int32_t threadIndex = 0; threadIndex < int32_t(threadContexts.size()); ++threadIndex)
+	{
+		threadContexts[threadIndex].thr = std::thread([
+			this,
+			&dp,
+			islandDp = dp.portfolio.empty() ? dp : dp.portfolio[threadIndex],
+			&threadContext = threadContexts[threadIndex],
+			threadIndex,
+			&islandsMx,
+			&best,
+			&bestLinear,
+			&temperatures,
+			&moveKindWeights
+		]() {
+			std::uniform_real_distribution<double> rdist(0.0, 1.0);
+			while (threadContext.ostate.temperature > islandDp.temperatureFinal && !cancelRequest)
+			{
+				threadContext.Optimize(islandDp);
+				auto linear = threadContext.ostate.state->GetCachedEnergy<Energy>(threadContext.workspace)->linear;
+				auto migrate = rdist(threadContext.rng) < *dp.migrationRate;
+				{
+					// published while still holding the lock, or an older best could overwrite a newer one
+					std::unique_lock lk(islandsMx);
+					if (bestLinear > linear)
+					{
+						best.state = threadContext.ostate.state;
+						best.coolingState = threadContext.ostate.coolingState;
+						best.portfolioIndex = threadIndex;
+						bestLinear = linear;
+					}
+					else if (migrate && linear > bestLinear)
+					{
+						threadContext.ostate.state = best.state;
+					}
+					// the slowest island decides how far along the dispatch is
+					temperatures[threadIndex] = threadContext.ostate.temperature;
+					best.temperature = *std::max_element(temperatures.begin(), temperatures.end());
+					moveKindWeights[threadIndex] = threadContext.ostate.moveKindWeights;
+					best.moveKindWeights = {};
+					for (int32_t moveKind = 0; moveKind < moveKindMax; ++moveKind)
+					{
+						for (auto &islandMoveKindWeights : moveKindWeights)
+						{
+							best.moveKindWeights[moveKind] += islandMoveKindWeights[moveKind] / double(moveKindWeights.size());
+						}
+						auto &stats = best.moveKindStats[moveKind];
+						auto &islandStats = threadContext.ostate.moveKindStats[moveKind];
+						stats.proposalCount += islandStats.proposalCount;
+						stats.acceptanceCount += islandStats.acceptanceCount;
+						stats.improvementSum += islandStats.improvementSum;
+					}
+					PokeState(best);
+				}
+			}
+		});
+	}
+	for (auto &threadContext : threadContexts)
+	{
+		threadContext.thr.join();
+	}
+}
+
+std::vector<Optimizer::DispatchParameters> Optimizer::SpreadPortfolio(const DispatchParameters &base, int32_t count, double spread)
+{
+	std::vector<DispatchParameters> portfolio(count, base);
+	for (int32_t entryIndex = 0; entryIndex < count; ++entryIndex)
+	{
+		auto &entry = portfolio[entryIndex];
+		entry.portfolio.clear();
+		if (count > 1)
+		{
+			entry.temperatureLoss *= std::pow(spread, 2.0 * double(entryIndex) / double(count - 1) - 1.0);
+		}
+	}
+	return portfolio;
+}
+
 void Optimizer::Wait()
 {
 	if (dispatched)
@@ -2,6 +2,7 @@
 #include <array>
 #include <atomic>
 #include <cstdint>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <random>
@@ -59,9 +60,57 @@ struct Source
 	int32_t nodeIndex;
 	int32_t outputIndex;
 	int32_t uses = 0;
+	std::vector<int32_t> outputStorageSlots;
+};
+
+// what it takes for a downstream link to have the node on the other end in the same layer
+enum SameLayerRule : uint8_t
+{
+	sameLayerIgnore,
+	sameLayerChain, // the other node has to come right after this one, at most one such link per node, saves a load
+	sameLayerSave, // saves a load
+	sameLayerForbid,
+};
+
+// frozen copy of the node and link graph in flat arrays, this is what hot loops read;
+// Index is uint16_t if every node index, link count, and source index fits, int32_t otherwise
+template<class Index>
+struct FlatGraph
+{
+	std::vector<uint8_t> nodeTypes;
+	std::vector<int16_t> workSlotsNeeded;
+	// sources of node n are sources[sourceBegins[n]] to sources[sourceBegins[n + 1] - 1], same for tmps
+	std::vector<Index> sourceBegins;
+	std::vector<Index> sources;
+	std::vector<Index> tmpBegins;
+	std::vector<uint8_t> tmps;
+	// link ends of node n in direction dir are at linkBegins[dir][n] to linkBegins[dir][n + 1] - 1,
+	// in the same order as in Node::linkIndices[dir]; the arrays below are indexed by link end
+	std::array<std::vector<Index>, linkMax> linkBegins;
+	std::array<std::vector<uint8_t>, linkMax> linkTypes;
+	std::array<std::vector<Index>, linkMax> linkedNodeIndices; // Link::directions[dir].nodeIndex
+	std::array<std::vector<Index>, linkMax> linkedLinkIndicesIndices; // Link::directions[dir].linkIndicesIndex
+	std::array<std::vector<Index>, linkMax> linkSources; // source of the upstream node that the link carries
+	std::array<std::vector<uint8_t>, linkMax> sameLayerRules; // SameLayerRule of the link, same at both of its ends
+
+	int32_t SourceCount(int32_t nodeIndex) const
+	{
+		return sourceBegins[nodeIndex + 1] - sourceBegins[nodeIndex];
+	}
+
+	int32_t TmpCount(int32_t nodeIndex) const
+	{
+		return tmpBegins[nodeIndex + 1] - tmpBegins[nodeIndex];
+	}
+
+	int32_t LinkCount(LinkDirection dir, int32_t nodeIndex) const
+	{
+		return linkBegins[dir][nodeIndex + 1] - linkBegins[dir][nodeIndex];
+	}
 };
 
 class State;
+class EnergyWorkspace;
 
 class Design : public std::enable_shared_from_this<Design>
 {
@@ -83,6 +132,19 @@ class Design : public std::enable_shared_from_this<Design>
 	};
 	std::vector<OutputLink> outputLinks;
 	std::vector<Source> sources;
+	std::vector<uint64_t> disallowConstantsInSlots; // one bit per storage slot
+	std::variant<FlatGraph<uint16_t>, FlatGraph<int32_t>> flat;
+	// random, layer hashes are the xor of these over the nodes in the layer
+	std::vector<uint64_t> nodeHashKeys;
+	// unique per constructed design, tells apart cached layer checks of different designs
+	uint64_t serial = 0;
+	// as-soon-as-possible and as-late-as-possible layers: a node can't be in a layer before layer asapLayers[n],
+	// and needs at least alapMargins[n] layers after its own; links that forbid their nodes being in the same layer
+	// push these apart, all other links only keep them in order
+	std::vector<int32_t> asapLayers;
+	std::vector<int32_t> alapMargins;
+	// commutative binary composites with two different operands, see State::operandsSwapped
+	std::vector<int32_t> swappableNodeIndices;
 
 	double storageSlotOverheadPenalty;
 
@@ -142,10 +204,28 @@ public:
 		return nodes;
 	}
 
+	const std::vector<int32_t> &AsapLayers() const
+	{
+		return asapLayers;
+	}
+
+	const std::vector<int32_t> &AlapMargins() const
+	{
+		return alapMargins;
+	}
+
+	// the last layer a node can be in if there are layerCount layers
+	int32_t AlapLayer(int32_t nodeIndex, int32_t layerCount) const
+	{
+		return layerCount - 1 - alapMargins[nodeIndex];
+	}
+
 	// TODO: get rid of this nonsense everywhere
 	friend class State;
 	friend class Energy;
 	friend class EnergyWithPlan;
+	friend class EnergyWorkspace;
+	friend class EnergyTracker;
 	friend std::ostream &operator <<(std::ostream &stream, const State &state);
 };
 
@@ -155,6 +235,131 @@ struct Move
 	int32_t layerIndex2 = -1;
 };
 
+enum Proposal
+{
+	proposalEnumerate, // pick one of all valid moves
+	proposalRejection, // draw candidate moves until a valid one comes up, same distribution without enumerating
+	proposalIndex, // pick one of the moves in a MoveIndex kept up to date across accepted moves
+	proposalGuided, // favour moves that may lower the peak of live storage slots, see State::GuidedMove
+};
+
+// how the temperature goes down after each iteration, see OptimizeParameters
+enum Cooling
+{
+	coolingLinear, // by temperatureLoss
+	coolingGeometric, // by a factor of 1 - temperatureLoss; never gets to a final temperature of 0
+	coolingAdaptive, // modified Lam: steered so that the rate of acceptance follows a target that falls over
+	                 // a run of 1 / temperatureLoss iterations; the temperature drops to the final one at the end
+};
+
+// moves other than single ones are drawn without enumerating them first, invalid ones are dropped
+enum MoveKind
+{
+	moveSingle, // one composite goes to another layer or to a new one, see Move
+	moveSwap, // two composites in different layers trade places
+	moveChain, // a run of composites chained by same-layer binary links goes to another layer or to a new one
+	moveMerge, // a layer joins the one before it
+	moveSplit, // the end of a layer goes to a new layer after it, starting somewhere it isn't chained
+	moveReorder, // a composite goes elsewhere in its own layer, which InsertNode otherwise decides
+	moveOperands, // a commutative binary composite takes its operands the other way around
+	moveKindMax,
+};
+using MoveKindWeights = std::array<double, moveKindMax>;
+constexpr MoveKindWeights singleMovesOnly = {{ 1.0 }};
+
+// what became of the moves of one kind, see OptimizerState
+struct MoveKindStats
+{
+	int64_t proposalCount = 0; // including invalid compound moves
+	int64_t acceptanceCount = 0;
+	double improvementSum = 0.0; // energy lost in accepted moves, less the energy gained
+};
+using MoveKindStatsArray = std::array<MoveKindStats, moveKindMax>;
+
+// how far along a cooling schedule is, carried from one round to the next, see OptimizerState
+struct CoolingState
+{
+	int64_t iterationCount = 0;
+	double acceptanceRate = 0.5; // moving average
+	double lowestEnergy = std::numeric_limits<double>::infinity();
+	int64_t stagnantIterationCount = 0; // since lowestEnergy was last lowered
+	int32_t reheatCount = 0;
+};
+
+// nodes whose State::PressureDirection isn't 0, see State::GuidedMove; kept up to date across moves
+// rather than found again for every proposal
+struct PressureNodeSet
+{
+	std::vector<int32_t> nodeIndices;
+	std::vector<int32_t> offsets; // into nodeIndices, per node, -1 if not in the set
+	std::vector<std::pair<int32_t, bool>> undoLog; // node and whether it was in the set, per change since Commit
+
+	void Set(int32_t nodeIndex, bool inSet);
+	void Undo();
+	void Commit()
+	{
+		undoLog.clear();
+	}
+};
+
+// all valid moves of a state, stored with stable layer ids rather than layer indices so that
+// inserting or removing a layer doesn't invalidate entries that refer to other layers;
+// a target id is layerId * 2 for moves into a layer and layerId * 2 + 1 for moves to a new layer right after it
+class MoveIndex
+{
+	struct Entry
+	{
+		int32_t nodeIndex;
+		int32_t targetId;
+		int32_t nodeEntriesIndex;
+		int32_t targetEntriesIndex;
+	};
+	std::vector<Entry> entries;
+	std::vector<std::vector<int32_t>> nodeEntries; // indices into entries, per node
+	std::vector<std::vector<int32_t>> targetEntries; // indices into entries, per target id
+	std::vector<int32_t> layerIds; // per layer index
+	std::vector<int32_t> layerIndices; // per layer id, -1 if the layer no longer exists
+	std::vector<int32_t> freeLayerIds;
+
+	// scratch space for State::TakeMoveIndex, kept here so that accepted moves don't allocate
+	std::vector<int32_t> newLayerIds;
+	std::vector<int32_t> redoNodeIndices;
+	std::vector<bool> redone; // per node
+	std::vector<int32_t> candidateNodeIndices;
+	std::vector<bool> candidate; // per node
+	std::vector<int32_t> recheckTargetIds;
+	std::vector<std::vector<int32_t>> recheckEntryIndices; // per target being rechecked and per node, -1 if there is none
+	std::vector<int32_t> removeEntryIndices;
+
+	void Add(int32_t nodeIndex, int32_t targetId);
+	void Remove(int32_t entryIndex);
+	void RemoveNode(int32_t nodeIndex);
+	void RemoveTarget(int32_t targetId);
+	int32_t NewLayerId();
+	void SetLayerIds(); // from newLayerIds
+
+	int32_t TargetLayerIndex2(int32_t targetId) const
+	{
+		return layerIndices[targetId / 2] * 2 + targetId % 2;
+	}
+
+	int32_t LayerIndex2Target(int32_t layerIndex2) const
+	{
+		return layerIds[layerIndex2 / 2] * 2 + layerIndex2 % 2;
+	}
+
+public:
+	int32_t Size() const
+	{
+		return int32_t(entries.size());
+	}
+
+	std::optional<Move> RandomMove(std::mt19937_64 &rng) const;
+	std::vector<Move> Moves() const;
+
+	friend class State;
+};
+
 struct Plan
 {
 	struct StepBase
@@ -295,6 +500,7 @@ public:
 	{
 		static constexpr int32_t layerOrder = 5;
 	};
+	static constexpr int32_t layerOrderCount = 6;
 
 	struct Load : public StepBase
 	{
@@ -362,10 +568,10 @@ public:
 	>;
 
 private:
+	// ordered by layer, then by layerOrder, then by tmp and storage slot where applicable
 	std::vector<Step> steps;
 
 	bool outputRemapFailed = false;
-	void SortSteps();
 
 public:
 	struct ToPlanFailed : public std::runtime_error
@@ -392,6 +598,7 @@ public:
 	}
 
 	friend class State;
+	friend class EnergyWorkspace;
 	friend std::ostream &operator <<(std::ostream &stream, const State &state);
 };
 
@@ -399,36 +606,332 @@ class State
 {
 	int32_t iteration;
 	std::shared_ptr<const Design> design;
-	std::vector<int32_t> nodeIndices;
-	std::vector<int32_t> layers;
+	// nodes of a layer in order; shared between states that have the same layer, e.g. between a state and
+	// its copies and neighbours, which only get their own copies of the layers they change
+	struct LayerBlock
+	{
+		std::vector<int32_t> nodeIndices;
+		uint64_t hash = 0; // xor of Design::nodeHashKeys of the nodes
+		uint64_t orderHash = 0; // of the node indices in order, independent of hash, see State::CheckInsertNode
+	};
+	std::vector<std::shared_ptr<LayerBlock>> layerBlocks; // only changed in place while not shared, see MutableLayer
+	std::vector<std::shared_ptr<LayerBlock>> spareLayerBlocks; // emptied layers, reused by AttachNode
+	std::vector<int32_t> nodeLayerIndices; // layer index of each node
+	// binary composites that load their lhs as if it was their rhs and vice versa; this decides which operand
+	// gets loaded with the operation and which one plainly, and so which loads can be Cloads; never set for
+	// nodes other than Design::swappableNodeIndices
+	std::vector<uint8_t> operandsSwapped;
+	// moves done by ApplyMove that UndoMove can still undo; not copied along with the state
+	struct UndoEntry
+	{
+		int32_t sourceLayerIndex;
+		int32_t sourceOffset;
+		bool sourceLayerRemoved;
+		int32_t targetLayerIndex;
+		int32_t targetOffset;
+		int32_t operandsSwappedNodeIndex = -1; // set instead of the above by SwapOperands
+	};
+	std::vector<UndoEntry> undoLog;
+	// scratch space for ApplyCompoundMove, not copied along with the state
+	std::vector<int32_t> compoundMovedNodeIndices;
+	std::vector<int32_t> compoundNodeIndices; // nodes of a layer, as the layer changes while they move
+	// only built on request, see BuildMoveIndex; never copied, as it only describes this exact layering
+	// and copies go on to be changed without it
+	std::unique_ptr<MoveIndex> moveIndex;
+	// filled on first use, accessed with std::atomic_load and std::atomic_store as states are shared between threads
+	mutable std::shared_ptr<const Energy> energyCache;
+	mutable std::shared_ptr<const EnergyWithPlan> energyWithPlanCache;
+
+	const std::vector<int32_t> &LayerNodes(int32_t layerIndex) const
+	{
+		return layerBlocks[layerIndex]->nodeIndices;
+	}
+
+	int32_t LayerSize(int32_t layerIndex) const
+	{
+		return int32_t(LayerNodes(layerIndex).size());
+	}
 
-	int32_t LayerSize(int32_t layerIndex) const;
+	// index of the upstream link that the node takes as its linkIndicesIndex-th operand
+	int32_t OperandLink(int32_t nodeIndex, int32_t linkIndicesIndex) const
+	{
+		return operandsSwapped[nodeIndex] ? (1 - linkIndicesIndex) : linkIndicesIndex;
+	}
+
+	LayerBlock &MutableLayer(int32_t layerIndex);
+	int32_t InsertPosition(int32_t layerIndex, int32_t extraNodeIndex) const;
 	std::vector<int32_t> InsertNode(int32_t layerIndex, int32_t extraNodeIndex) const;
-	std::vector<int32_t> NodeIndexToLayerIndex() const;
+	void DetachNode(int32_t layerIndex, int32_t offset);
+	void AttachNode(int32_t nodeIndex, int32_t layerIndex, int32_t offset, bool newLayer);
+	// same as design->CheckLayer(InsertNode(...)), but goes through a per-thread cache of recent checks
+	bool CheckInsertNode(int32_t layerIndex, int32_t extraNodeIndex) const;
+	struct MoveLimits
+	{
+		std::array<int32_t, linkMax> limit; // range of layerIndex2 values the node can go to
+		std::array<int32_t, linkMax> skip; // range within the above that would leave it where it is
+	};
+	MoveLimits GetMoveLimits(int32_t nodeIndex) const;
+	// cheap check against the node's mobility window, see Design::asapLayers; moves outside are never valid
+	bool MoveInWindow(const Move &move) const;
+	bool MoveValid(const Move &move, const MoveLimits &moveLimits) const;
+	// whether the node is in the right layer relative to the nodes it's linked to, see GetMoveLimits
+	bool PlacementValid(int32_t nodeIndex) const;
+	bool ChainedTo(int32_t nodeIndex, int32_t nextNodeIndex) const;
+	void UndoMovesTo(size_t undoLogSize);
+	// same as ApplyMove, but within the layer and without regard for InsertPosition
+	void ReorderNode(int32_t layerIndex, int32_t offset, int32_t newOffset);
+	void SwapOperands(int32_t nodeIndex);
+	void NodeValidMoves(int32_t nodeIndex, std::vector<Move> &moves) const;
 	std::vector<Move> ValidMoves() const;
-	int32_t LayerBegins(int32_t layerIndex) const;
+	void AddNodeMoves(int32_t nodeIndex);
+	// 1 if the node produces a value still live after the peak layer, -1 if it consumes a value that was already live
+	// before it, 0 otherwise; moving these later or earlier respectively may shorten the lives of those values
+	int32_t PressureDirection(int32_t nodeIndex, int32_t peakLayerIndex) const;
+	void CheckMoveIndex() const;
 
 public:
 	State() = default;
-	std::shared_ptr<State> RandomNeighbour(std::mt19937_64 &rng) const;
+	State(const State &other);
+	State &operator =(const State &other);
+
+	std::shared_ptr<State> RandomNeighbour(std::mt19937_64 &rng, Proposal proposal = proposalRejection, const MoveKindWeights &moveKindWeights = singleMovesOnly) const;
+	std::optional<Move> RandomMove(std::mt19937_64 &rng, Proposal proposal = proposalRejection) const;
+	std::shared_ptr<State> Neighbour(const Move &move) const;
+	// makes this state the same as other without sharing layers with it, so that the two can be changed
+	// in different threads; the layers of this state are reused, they mustn't be shared either
+	void AssignDetached(const State &other);
+	// layers before this one are the same in this state and in Neighbour(move)
+	int32_t FirstLayerAffectedBy(const Move &move) const;
+	// 1 if the move takes the node to a later layer, -1 if to an earlier one
+	int32_t MoveDirection(const Move &move) const;
+
+	// proposalGuided needs the peak layer from an EnergyTracker and the nodes around it, see PressureDirection;
+	// GuidedMove picks one of those nodes some of the time and one of its moves in the direction that helps,
+	// and any composite and any of its moves otherwise; this isn't symmetric, GuidedMoveProbability gives
+	// the probability of proposing a specific move of a node in a direction for Metropolis-Hastings, given all valid
+	// moves of the node if they're known already, like those GuidedMove leaves in nodeMoves
+	void PressureNodes(int32_t peakLayerIndex, PressureNodeSet &pressureNodes) const;
+	// updates the set after the last ApplyMove, which only changes it around the moved node as long as the layers
+	// up to the peak layer stay where they are; false if they don't, in which case the set needs PressureNodes;
+	// changes are logged in the set so that they can be undone
+	bool UpdatePressureNodes(int32_t movedNodeIndex, int32_t peakLayerIndex, PressureNodeSet &pressureNodes) const;
+	std::optional<Move> GuidedMove(std::mt19937_64 &rng, int32_t peakLayerIndex, const std::vector<int32_t> &pressureNodeIndices, std::vector<Move> &nodeMoves) const;
+	double GuidedMoveProbability(int32_t nodeIndex, int32_t direction, int32_t peakLayerIndex, int32_t pressureNodeCount, const std::vector<Move> &nodeMoves) const;
+	double GuidedMoveProbability(int32_t nodeIndex, int32_t direction, int32_t peakLayerIndex, int32_t pressureNodeCount) const;
+	// turn this state into Neighbour(move) in place; moves can then be undone in reverse order
+	// until ForgetMoves is called; not compatible with a move index
+	void ApplyMove(const Move &move);
+	void UndoMove();
+	void UndoMoves()
+	{
+		UndoMovesTo(0);
+	}
+	void ForgetMoves()
+	{
+		undoLog.clear();
+	}
+	// draws a move of any kind but moveSingle and applies it in place like ApplyMove; returns the first layer
+	// affected by it, or nothing if the move drawn wasn't valid, in which case the state is left as it was
+	std::optional<int32_t> ApplyCompoundMove(std::mt19937_64 &rng, MoveKind kind);
+
+	// RandomMove with proposalIndex needs a move index; build one from scratch, or take over the one
+	// of the state this one is the Neighbour(move) of and update it, which only rechecks moves the move may affect
+	void BuildMoveIndex();
+	void TakeMoveIndex(State &from, const Move &move);
+	const MoveIndex *GetMoveIndex() const
+	{
+		return moveIndex.get();
+	}
+	void DropMoveIndex()
+	{
+		moveIndex.reset();
+	}
 
 	template<class EnergyType>
 	EnergyType GetEnergy() const;
+	template<class EnergyType>
+	EnergyType GetEnergy(EnergyWorkspace &workspace) const;
+
+	// evaluated at most once per energy type and state, unless two threads happen to ask at the same time
+	template<class EnergyType>
+	std::shared_ptr<const EnergyType> GetCachedEnergy() const;
+	template<class EnergyType>
+	std::shared_ptr<const EnergyType> GetCachedEnergy(EnergyWorkspace &workspace) const;
+	// for callers that already know the energy of this state, e.g. from an EnergyTracker
+	void SetCachedEnergy(Energy energy) const;
 
 	const Design *GetDesign() const
 	{
 		return design.get();
 	}
 
-	const std::vector<int32_t> &GetLayers() const
+	int32_t LayerCount() const
 	{
-		return layers;
+		return int32_t(layerBlocks.size());
 	}
 
 	friend class Design;
+	friend class EnergyWorkspace;
+	friend class EnergyTracker;
 	friend std::ostream &operator <<(std::ostream &stream, const State &state);
 };
 
+// scratch buffers for energy evaluation, reset between evaluations instead of being reallocated;
+// not safe to share between threads, each optimizer thread owns one
+class EnergyWorkspace
+{
+	struct Storage
+	{
+		int32_t usesLeft = 0;
+		int32_t slotIndex = -1;
+	};
+	struct OutputRemap
+	{
+		int32_t from, to;
+	};
+	struct StoreScheduleEntry
+	{
+		int32_t sourceIndex;
+		int32_t workSlotIndex;
+		std::optional<int32_t> cworkSlotIndex;
+	};
+	struct JournalEntry
+	{
+		enum Target
+		{
+			slotFree,
+			storageUsesLeft,
+			storageSlotIndex,
+		} target;
+		int32_t index;
+		int32_t oldValue;
+		int32_t newValue;
+	};
+	struct Checkpoint
+	{
+		int32_t journalSize;
+		int32_t slotCount;
+		int32_t partCount;
+		int32_t liveSlotCount;
+	};
+
+	std::shared_ptr<const Design> design;
+	std::vector<Storage> storage;
+	int32_t slotCount = 0;
+	std::vector<uint64_t> freeSlots; // one bit per slot, set if free; bits past slotCount are clear
+	std::vector<OutputRemap> outputRemaps;
+	std::vector<uint32_t> nodeLayerStamps;
+	uint32_t layerStamp = 0;
+	std::vector<StoreScheduleEntry> storeSchedule;
+	std::vector<int32_t> selectStorageSlotSchedule;
+	std::array<int32_t, tmpCount> tmpUsed;
+	std::vector<uint64_t> tmpSlotUsed; // one slot bitset per tmp, only cleared when the tmp is first used in a layer
+
+	// steps pushed with the same key stay in the order they were pushed in, keys are drained in ascending order
+	struct PlanChains
+	{
+		struct Entry
+		{
+			EnergyWithPlan::Step step;
+			int32_t next;
+		};
+		std::vector<Entry> entries;
+		std::vector<std::pair<int32_t, int32_t>> ends; // first and last entry per key, only valid if the key is set
+		std::vector<uint64_t> keys;
+
+		void Push(int32_t key, const EnergyWithPlan::Step &step);
+		template<class Func>
+		void Drain(Func &&func);
+	};
+	// plan steps of the current layer, bucketed so that they come out in final order without sorting
+	std::array<std::vector<EnergyWithPlan::Step>, EnergyWithPlan::layerOrderCount> planSteps;
+	std::array<PlanChains, tmpCount> planLoads; // Mode, Load, and Cload, keyed by storage slot
+	PlanChains planStores; // Store and Cstore, keyed by storage slot
+
+	bool tracking = false;
+	std::vector<JournalEntry> journal;
+	std::vector<Checkpoint> checkpoints; // state before each layer, the last one is the final state
+	std::vector<JournalEntry> savedJournal;
+	std::vector<Checkpoint> savedCheckpoints;
+
+	int32_t Read(JournalEntry::Target target, int32_t index) const;
+	void Apply(JournalEntry::Target target, int32_t index, int32_t value);
+	void Write(JournalEntry::Target target, int32_t index, int32_t value);
+	bool SlotFree(int32_t slotIndex) const;
+	int32_t LiveSlotCount() const;
+	void ResizeSlots(int32_t newSlotCount);
+	void PushPlanStep(const EnergyWithPlan::Step &step);
+	void CommitPlanLayer(EnergyWithPlan &energy, int32_t layerIndex);
+
+	template<class EnergyType>
+	int32_t AllocStorage(int32_t layerIndex, int32_t sourceIndex, bool forConstant, std::optional<int32_t> freeSlotIndex);
+	template<class EnergyType>
+	int32_t UseStorage(int32_t layerIndex, int32_t sourceIndex);
+	template<class EnergyType>
+	void BeginLayers(const State &state, EnergyType &energy);
+	template<class EnergyType>
+	void Layer(const State &state, int32_t layerIndex, EnergyType &energy);
+	template<class EnergyType>
+	void EndLayers(const State &state, EnergyType &energy);
+
+	friend class State;
+	friend class EnergyTracker;
+};
+
+// keeps per-layer checkpoints of storage allocation so that the energy of a neighbour
+// can be evaluated starting from the first layer the move affects
+class EnergyTracker
+{
+	EnergyWorkspace &workspace;
+	Energy energy;
+	int32_t proposedFrom = -1;
+
+	void Rewind(const EnergyWorkspace::Checkpoint &checkpoint);
+	EnergyWorkspace::Checkpoint MakeCheckpoint() const;
+	Energy TrackedEnergy() const;
+	void CopyFrom(int32_t firstLayerIndex, std::vector<EnergyWorkspace::Checkpoint> &checkpoints, std::vector<EnergyWorkspace::JournalEntry> &journal) const;
+	// puts back checkpoints and journal entries from CopyFrom in place of the ones from firstLayerIndex on
+	void Restore(int32_t firstLayerIndex, const std::vector<EnergyWorkspace::Checkpoint> &checkpoints, const std::vector<EnergyWorkspace::JournalEntry> &journal);
+
+public:
+	EnergyTracker(EnergyWorkspace &newWorkspace) : workspace(newWorkspace)
+	{
+	}
+
+	// a state set aside by Keep, to be proposed again later without evaluating it again
+	struct KeptProposal
+	{
+		int32_t firstLayerIndex = -1;
+		std::vector<EnergyWorkspace::Checkpoint> checkpoints;
+		std::vector<EnergyWorkspace::JournalEntry> journal;
+	};
+
+	Energy Reset(const State &state);
+	// same as Reset with the state other was last reset to or accepted, without evaluating it again
+	Energy Reset(const EnergyTracker &other);
+	Energy Propose(const State &neighbour, int32_t firstLayerIndex);
+	// proposes a kept state again; the layers before its firstLayerIndex must be as they were when it was kept
+	Energy Propose(const KeptProposal &kept);
+	// keeps the state last proposed, or the one last reset to or accepted if there's no proposal in progress,
+	// as if it was proposed from firstLayerIndex; that of the proposal if there's one
+	void Keep(KeptProposal &kept, int32_t firstLayerIndex) const;
+	void Accept();
+	void Reject();
+	// the composite layer after which the most storage slots are live in the state last reset to or proposed,
+	// or -1 if that state doesn't need more storage slots than the design has
+	int32_t PeakLayer() const;
+};
+
+struct IncrementalEnergyMismatch : public std::logic_error
+{
+	using logic_error::logic_error;
+};
+
+struct MoveIndexMismatch : public std::logic_error
+{
+	using logic_error::logic_error;
+};
+
 struct StreamFailed : public std::runtime_error
 {
 	using runtime_error::runtime_error;
@@ -449,13 +952,63 @@ struct OptimizeParameters
 	double temperatureInitial;
 	double temperatureFinal;
 	double temperatureLoss;
+	Proposal proposal = proposalRejection;
+	MoveKindWeights moveKindWeights = singleMovesOnly; // compound moves need proposalRejection or proposalEnumerate
+	// if set, moveKindWeights are only where selection starts from, probabilities then follow
+	// the kinds that lose the most energy per layer evaluated, see OptimizeOnce
+	bool adaptiveMoveKinds = false;
+	// number of threads that evaluate consecutive moves from the same state at once, for a single chain that
+	// rejects most moves; the outcome is the same as with 1, see OptimizeOnce; only for single moves
+	// with proposalRejection or proposalEnumerate and a schedule that doesn't depend on the moves,
+	// i.e. linear or geometric cooling without reheating; other settings are annealed one move at a time
+	int32_t speculation = 1;
+	// number of candidates per single move, multiple-try Metropolis if more than 1, which finds better moves
+	// at low temperatures for about twice as many evaluations; only for proposalRejection or proposalEnumerate,
+	// and speculation doesn't apply then
+	int32_t multiTry = 1;
+	Cooling cooling = coolingLinear;
+	// if not 0, the temperature goes up by a factor of reheatFactor after this many iterations without a new
+	// lowest energy, at most reheatLimit times
+	int32_t reheatAfter = 0;
+	double reheatFactor = 2.0;
+	int32_t reheatLimit = 1;
+	CoolingState coolingState = {}; // where the schedule starts from
+	// if set, checked every so often, and OptimizeOnce returns what it has so far once it's true
+	const std::atomic<bool> *cancelRequest = nullptr;
 };
 struct OptimizerState
 {
 	std::shared_ptr<const State> state;
 	double temperature;
+	MoveKindWeights moveKindWeights = {}; // move kind weights in effect at the end, all zero if not set by OptimizeOnce
+	MoveKindStatsArray moveKindStats = {};
+	CoolingState coolingState = {};
+	// the thread, and so the portfolio entry, that came up with the state in Optimizer::Dispatch, or -1
+	int32_t portfolioIndex = -1;
 };
 OptimizerState OptimizeOnce(std::mt19937_64 &rng, const State &stateIn, OptimizeParameters op);
+OptimizerState OptimizeOnce(std::mt19937_64 &rng, EnergyWorkspace &workspace, const State &stateIn, OptimizeParameters op);
+
+// temperatures in units of energy for a design, from the energy deltas of sampleCount random moves in a walk
+// that starts from a state; uphill moves among those are accepted with a mean probability of acceptanceInitial
+// at the initial temperature, and the smallest uphill move with a probability of acceptanceFinal at the final one;
+// the loss is such that the schedule gets from one to the other in iterationCount iterations, see Cooling
+struct CalibrationParameters
+{
+	int64_t iterationCount;
+	Cooling cooling = coolingLinear;
+	double acceptanceInitial = 0.3;
+	double acceptanceFinal = 0.001;
+	int32_t sampleCount = 1000;
+};
+struct Calibration
+{
+	double temperatureInitial;
+	double temperatureFinal;
+	double temperatureLoss;
+	int32_t uphillCount; // moves sampled that were uphill, if none, the deltas are taken to be 1
+};
+Calibration Calibrate(std::mt19937_64 &rng, const State &stateIn, CalibrationParameters cp);
 
 class Optimizer
 {
@@ -477,7 +1030,33 @@ public:
 		int32_t iterationCount;
 		double temperatureFinal;
 		double temperatureLoss;
+		Proposal proposal = proposalRejection;
+		MoveKindWeights moveKindWeights = singleMovesOnly;
+		// weights are carried across rounds by each thread, the state holds the statistics of the last round
+		// and the weights averaged over threads
+		bool adaptiveMoveKinds = false;
+		// replica exchange if not empty: one ratio to the published temperature per thread, ascending; each thread
+		// keeps its own chain at that ratio, neighbouring chains may swap states after each round, and the first
+		// chain is the one published; otherwise all threads start each round from the published state
+		std::vector<double> temperatureLadder;
+		// island mode if set: each thread anneals its own chain and doesn't wait for the others, improvements
+		// are published right away, and after each round a thread adopts the best state so far with this
+		// probability if it's better than its own; the statistics held by the state cover the whole dispatch
+		std::optional<double> migrationRate;
+		int32_t speculation = 1; // per thread, see OptimizeParameters
+		int32_t multiTry = 1;
+		Cooling cooling = coolingLinear; // the schedule carries on across rounds, see OptimizeParameters
+		int32_t reheatAfter = 0;
+		double reheatFactor = 2.0;
+		int32_t reheatLimit = 1;
+		// portfolio mode if not empty: one entry per thread, which then anneals with the schedule, proposal and move
+		// kinds of that entry; the rest comes from this one; in the round-based modes, the temperature goes on
+		// from the thread that came up with the best state, see OptimizerState::portfolioIndex, and the dispatch
+		// ends once every thread is down to the final temperature of its entry
+		std::vector<DispatchParameters> portfolio;
 	};
+	// count copies of base with temperature losses spread geometrically between base / spread and base * spread
+	static std::vector<DispatchParameters> SpreadPortfolio(const DispatchParameters &base, int32_t count, double spread);
 	void Dispatch(DispatchParameters dp);
 	void Wait();
 	void Cancel();
@@ -496,4 +1075,7 @@ public:
 	}
 
 	~Optimizer();
+
+private:
+	void RunIslands(const DispatchParameters &dp);
 };